@@ -787,6 +787,22 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
+    /* Requests spanning several clusters are compressed one cluster at a
+       time */
+    if (nb_sectors > s->cluster_sectors) {
+        while (nb_sectors > 0) {
+            int n = MIN(nb_sectors, s->cluster_sectors);
+            ret = qcow_write_compressed(bs, sector_num, buf, n);
+            if (ret < 0) {
+                return ret;
+            }
+            sector_num += n;
+            buf += n * BDRV_SECTOR_SIZE;
+            nb_sectors -= n;
+        }
+        return 0;
+    }
+
     if (nb_sectors != s->cluster_sectors) {
         ret = -EINVAL;
 
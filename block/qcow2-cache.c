@@ -27,12 +27,18 @@
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Cached tables are looked up by offset through a hash table and replaced
+ * in least recently used order.  All tables live in one buffer, so that the
+ * entry of a table handed out by qcow2_cache_get() is found by its address.
+ */
 typedef struct Qcow2CachedTable {
     void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
     int     ref;
+    int     hash_next;      /* next entry in the same hash bucket, or -1 */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -40,20 +46,42 @@ struct Qcow2Cache {
     struct Qcow2Cache*      depends;
     int                     size;
     bool                    depends_on_flush;
+    void*                   table_array;
+    int                     table_bits;
+    int*                    hash;
+    unsigned int            hash_mask;
+    /* least recently used first */
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
 };
 
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
+    unsigned int buckets;
     int i;
 
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->table_bits = s->cluster_bits;
+    c->table_array = qemu_blockalign(bs, (size_t)num_tables << c->table_bits);
 
+    buckets = 1;
+    while (buckets < num_tables) {
+        buckets <<= 1;
+    }
+    c->hash_mask = buckets - 1;
+    c->hash = g_malloc(sizeof(*c->hash) * buckets);
+    for (i = 0; i < buckets; i++) {
+        c->hash[i] = -1;
+    }
+
+    QTAILQ_INIT(&c->lru);
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        c->entries[i].table = c->table_array + ((size_t)i << c->table_bits);
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
     }
 
     return c;
@@ -65,15 +93,67 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->hash);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+static unsigned int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return (offset >> c->table_bits) & c->hash_mask;
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->hash[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Set the offset of an entry, keeping the hash table in sync */
+static void qcow2_cache_set_offset(Qcow2Cache *c, int i, int64_t offset)
+{
+    int *pi;
+
+    if (c->entries[i].offset) {
+        pi = &c->hash[qcow2_cache_hash(c, c->entries[i].offset)];
+        while (*pi != i) {
+            pi = &c->entries[*pi].hash_next;
+        }
+        *pi = c->entries[i].hash_next;
+        c->entries[i].hash_next = -1;
+    }
+
+    c->entries[i].offset = offset;
+    if (offset) {
+        pi = &c->hash[qcow2_cache_hash(c, offset)];
+        c->entries[i].hash_next = *pi;
+        *pi = i;
+    }
+}
+
+static int qcow2_cache_table_index(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t off = (uint8_t *)table - (uint8_t *)c->table_array;
+
+    if (off < 0 || off >= ((ptrdiff_t)c->size << c->table_bits) ||
+        (off & ((1 << c->table_bits) - 1))) {
+        return -1;
+    }
+    return off >> c->table_bits;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -187,32 +267,18 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    Qcow2CachedTable *t;
 
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
+    /* Only the few tables currently in use need to be skipped */
+    QTAILQ_FOREACH(t, &c->lru, lru) {
+        if (!t->ref) {
+            return t - c->entries;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
-        }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -226,10 +292,9 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        goto found;
     }
 
     /* If not, write a table back and replace it */
@@ -247,7 +312,7 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_set_offset(c, i, 0);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -259,14 +324,12 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(c, i, offset);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    QTAILQ_REMOVE(&c->lru, &c->entries[i], lru);
+    QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
     c->entries[i].ref++;
     *table = c->entries[i].table;
 
@@ -292,14 +355,11 @@ int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
     int i;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
+    i = qcow2_cache_table_index(c, *table);
+    if (i < 0) {
+        return -ENOENT;
     }
-    return -ENOENT;
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -311,13 +371,10 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
     int i;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
+    i = qcow2_cache_table_index(c, table);
+    if (i < 0) {
+        abort();
     }
-    abort();
 
-found:
     c->entries[i].dirty = true;
 }
@@ -27,6 +27,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "trace.h"
 
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
@@ -634,11 +635,25 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
         return 0;
     }
 
-    qemu_co_mutex_unlock(&s->lock);
-    ret = copy_sectors(bs, m->offset / BDRV_SECTOR_SIZE, m->alloc_offset,
-                       r->offset / BDRV_SECTOR_SIZE,
-                       r->offset / BDRV_SECTOR_SIZE + r->nb_sectors);
-    qemu_co_mutex_lock(&s->lock);
+    if (m->cow_merged || (m->cow_from_zero && m->alloc_beyond_eof)) {
+        /* Already written together with the guest data, or fresh space at
+         * the end of the file that is a hole; the ordering below still
+         * applies */
+        ret = 0;
+    } else if (m->cow_from_zero) {
+        qemu_co_mutex_unlock(&s->lock);
+        BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
+        ret = bdrv_co_write_zeroes(bs->file,
+                                   (m->alloc_offset + r->offset) >> 9,
+                                   r->nb_sectors);
+        qemu_co_mutex_lock(&s->lock);
+    } else {
+        qemu_co_mutex_unlock(&s->lock);
+        ret = copy_sectors(bs, m->offset / BDRV_SECTOR_SIZE, m->alloc_offset,
+                           r->offset / BDRV_SECTOR_SIZE,
+                           r->offset / BDRV_SECTOR_SIZE + r->nb_sectors);
+        qemu_co_mutex_lock(&s->lock);
+    }
 
     if (ret < 0) {
         return ret;
@@ -1006,7 +1021,9 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t *l2_table;
     uint64_t entry;
     unsigned int nb_clusters;
-    int ret;
+    int ret, i;
+    bool cow_from_zero;
+    int64_t file_length;
 
     uint64_t alloc_cluster_offset;
 
@@ -1044,11 +1061,32 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
      * wrong with our code. */
     assert(nb_clusters > 0);
 
+    /*
+     * If all old clusters read as zeroes, COW doesn't need to read anything.
+     * Encrypted images must still go through copy_sectors() because the
+     * zeroes have to be encrypted.
+     */
+    cow_from_zero = !s->crypt_method;
+    for (i = 0; cow_from_zero && i < nb_clusters; i++) {
+        switch (qcow2_get_cluster_type(be64_to_cpu(l2_table[l2_index + i]))) {
+        case QCOW2_CLUSTER_ZERO:
+            break;
+        case QCOW2_CLUSTER_UNALLOCATED:
+            cow_from_zero = !bs->backing_hd;
+            break;
+        default:
+            cow_from_zero = false;
+            break;
+        }
+    }
+
     ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
     if (ret < 0) {
         return ret;
     }
 
+    file_length = cow_from_zero ? bdrv_getlength(bs->file) : -1;
+
     /* Allocate, if necessary at a given offset in the image file */
     alloc_cluster_offset = start_of_cluster(s, *host_offset);
     ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
@@ -1105,6 +1143,10 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
             .offset     = nb_sectors * BDRV_SECTOR_SIZE,
             .nb_sectors = avail_sectors - nb_sectors,
         },
+
+        .cow_from_zero      = cow_from_zero,
+        .alloc_beyond_eof   = cow_from_zero && file_length >= 0 &&
+                              alloc_cluster_offset >= file_length,
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
     QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
@@ -1279,28 +1321,165 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+typedef struct Qcow2DecompressData {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+} Qcow2DecompressData;
+
+/* Runs in a thread pool worker */
+static int qcow2_decompress_func(void *opaque)
+{
+    Qcow2DecompressData *data = opaque;
+
+    if (decompress_buffer(data->out_buf, data->out_buf_size,
+                          data->buf, data->buf_size) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static Qcow2CompressedCacheEntry *compressed_cache_find(BDRVQcowState *s,
+                                                        uint64_t coffset)
+{
+    int i;
+
+    for (i = 0; i < COMPRESSED_CACHE_SIZE; i++) {
+        if (s->cluster_cache[i].data && s->cluster_cache[i].offset == coffset) {
+            return &s->cluster_cache[i];
+        }
+    }
+    return NULL;
+}
+
+static Qcow2CompressedCacheEntry *compressed_cache_victim(BDRVQcowState *s)
+{
+    Qcow2CompressedCacheEntry *victim = &s->cluster_cache[0];
+    int i;
+
+    for (i = 0; i < COMPRESSED_CACHE_SIZE; i++) {
+        if (!s->cluster_cache[i].data || s->cluster_cache[i].offset == -1) {
+            return &s->cluster_cache[i];
+        }
+        if (s->cluster_cache[i].lru_counter < victim->lru_counter) {
+            victim = &s->cluster_cache[i];
+        }
+    }
+    return victim;
+}
+
+/*
+ * Drops all decompressed clusters. Must be called before a compressed
+ * cluster can be freed, because its host offset may be reused afterwards.
+ */
+void qcow2_compressed_cache_invalidate(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < COMPRESSED_CACHE_SIZE; i++) {
+        s->cluster_cache[i].offset = -1;
+    }
+    s->cluster_cache_generation++;
+}
+
+void qcow2_compressed_cache_destroy(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < COMPRESSED_CACHE_SIZE; i++) {
+        g_free(s->cluster_cache[i].data);
+        s->cluster_cache[i].data = NULL;
+    }
+}
+
+/*
+ * Looks up the compressed cluster at cluster_offset in the cache of
+ * decompressed clusters and reads and inflates it on a miss. On success
+ * *data points to the decompressed cluster; it stays valid only as long as
+ * the caller holds s->lock.
+ *
+ * Must be called with s->lock held. The lock is dropped while the compressed
+ * data is read and inflated, so that several clusters can be in flight.
+ */
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          uint8_t **data)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressedCacheEntry *entry;
+    Qcow2DecompressData job;
+    ThreadPool *pool;
+    QEMUIOVector qiov;
+    struct iovec iov;
     int ret, csize, nb_csectors, sector_offset;
-    uint64_t coffset;
+    uint64_t coffset, generation;
+    uint8_t *cbuf, *out_buf;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
-            return ret;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
-        }
-        s->cluster_cache_offset = coffset;
+    entry = compressed_cache_find(s, coffset);
+    if (entry) {
+        entry->lru_counter = ++s->cluster_cache_lru_counter;
+        *data = entry->data;
+        return 0;
+    }
+
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+
+    cbuf = qemu_blockalign(bs, nb_csectors * 512);
+    out_buf = g_malloc(s->cluster_size);
+    generation = s->cluster_cache_generation;
+
+    qemu_co_mutex_unlock(&s->lock);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    iov.iov_base = cbuf;
+    iov.iov_len = nb_csectors * 512;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = bdrv_co_readv(bs->file, coffset >> 9, nb_csectors, &qiov);
+    if (ret >= 0) {
+        job = (Qcow2DecompressData) {
+            .out_buf        = out_buf,
+            .out_buf_size   = s->cluster_size,
+            .buf            = cbuf + sector_offset,
+            .buf_size       = csize,
+        };
+        pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+        ret = thread_pool_submit_co(pool, qcow2_decompress_func, &job);
     }
+
+    qemu_co_mutex_lock(&s->lock);
+    qemu_vfree(cbuf);
+
+    if (ret < 0) {
+        g_free(out_buf);
+        return ret;
+    }
+
+    /* Another request may have decompressed the same cluster meanwhile */
+    entry = compressed_cache_find(s, coffset);
+    if (entry) {
+        g_free(out_buf);
+    } else if (generation != s->cluster_cache_generation) {
+        /* The cache was invalidated meanwhile; hand the data to the caller
+         * through a slot, but don't publish it under its offset */
+        entry = compressed_cache_victim(s);
+        g_free(entry->data);
+        entry->data = out_buf;
+        entry->offset = -1;
+    } else {
+        entry = compressed_cache_victim(s);
+        g_free(entry->data);
+        entry->data = out_buf;
+        entry->offset = coffset;
+    }
+
+    entry->lru_counter = ++s->cluster_cache_lru_counter;
+    *data = entry->data;
     return 0;
 }
 
@@ -25,6 +25,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "qemu/timer.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
@@ -418,6 +419,207 @@ fail_block:
     return ret;
 }
 
+/*********************************************************/
+/* refcount block journal */
+
+/*
+ * With lazy refcounts, modified refcount blocks are only written back when the
+ * cache is flushed, so after a crash any of them may be stale. The refcount
+ * block journal is a cluster that lists the refcount table indices of these
+ * blocks; it is updated before a block is modified for the first time, so that
+ * opening a dirty image only needs to repair the blocks listed there.
+ */
+
+static void refcount_flush_schedule(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->refcount_flush_timer &&
+        !qemu_timer_pending(s->refcount_flush_timer)) {
+        qemu_mod_timer(s->refcount_flush_timer,
+                       qemu_get_clock_ms(vm_clock) + REFCOUNT_FLUSH_INTERVAL_MS);
+    }
+}
+
+static int refblock_journal_add(BlockDriverState *bs, int64_t table_index)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t entry, val;
+    int i, ret;
+
+    if (!s->use_lazy_refcounts) {
+        return 0;
+    }
+
+    refcount_flush_schedule(bs);
+
+    if (!s->refblock_journal_offset ||
+        s->nb_refblock_journal == s->refblock_journal_slots) {
+        return 0;
+    }
+
+    for (i = 0; i < s->nb_refblock_journal; i++) {
+        if (s->refblock_journal[i] == table_index) {
+            return 0;
+        }
+    }
+
+    /* The last slot records that the journal overflowed */
+    if (s->nb_refblock_journal == s->refblock_journal_slots - 1) {
+        entry = REFBLOCK_JOURNAL_OVERFLOW;
+    } else {
+        entry = REFBLOCK_JOURNAL_VALID | table_index;
+    }
+
+    val = cpu_to_be64(entry);
+    ret = bdrv_pwrite(bs->file, s->refblock_journal_offset +
+                      s->nb_refblock_journal * sizeof(uint64_t),
+                      &val, sizeof(val));
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->refblock_journal[s->nb_refblock_journal++] =
+        entry == REFBLOCK_JOURNAL_OVERFLOW ? entry : table_index;
+    return 0;
+}
+
+/* Reads the journal entries that a previous user of the image left */
+int qcow2_refblock_journal_load(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *journal;
+    int i, ret;
+
+    journal = g_malloc(s->refblock_journal_slots * sizeof(uint64_t));
+    ret = bdrv_pread(bs->file, s->refblock_journal_offset, journal,
+                     s->refblock_journal_slots * sizeof(uint64_t));
+    if (ret < 0) {
+        goto out;
+    }
+
+    s->nb_refblock_journal = 0;
+    for (i = 0; i < s->refblock_journal_slots; i++) {
+        uint64_t entry = be64_to_cpu(journal[i]);
+
+        if (!(entry & REFBLOCK_JOURNAL_VALID)) {
+            break;
+        }
+        if (entry == REFBLOCK_JOURNAL_OVERFLOW) {
+            /* Anything may be stale, treat the journal as full */
+            s->nb_refblock_journal = s->refblock_journal_slots;
+            break;
+        }
+        s->refblock_journal[s->nb_refblock_journal++] =
+            entry & ~REFBLOCK_JOURNAL_VALID;
+    }
+
+    ret = 0;
+out:
+    g_free(journal);
+    return ret;
+}
+
+/*
+ * Allocates an empty journal cluster and records it in the image header. Only
+ * call this for a clean image.
+ */
+int qcow2_refblock_journal_enable(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t offset;
+    uint8_t *buf;
+    int ret;
+
+    offset = qcow2_alloc_clusters(bs, s->cluster_size);
+    if (offset < 0) {
+        return offset;
+    }
+
+    /* The header must not point to a cluster that is still free on disk */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    buf = qemu_blockalign(bs, s->cluster_size);
+    memset(buf, 0, s->cluster_size);
+    ret = bdrv_pwrite(bs->file, offset, buf, s->cluster_size);
+    qemu_vfree(buf);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->refblock_journal_offset = offset;
+    s->nb_refblock_journal = 0;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_REFBLOCK_JOURNAL;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->refblock_journal_offset = 0;
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_REFBLOCK_JOURNAL;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    qcow2_free_clusters(bs, offset, s->cluster_size);
+    return ret;
+}
+
+/* Removes the journal from a clean image */
+int qcow2_refblock_journal_disable(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t offset = s->refblock_journal_offset;
+    int ret;
+
+    s->refblock_journal_offset = 0;
+    s->nb_refblock_journal = 0;
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_REFBLOCK_JOURNAL;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qcow2_free_clusters(bs, offset, s->cluster_size);
+    return 0;
+}
+
+/*
+ * Empties the journal. Only call this after all refcount blocks have been
+ * written back to the image file.
+ */
+int qcow2_refblock_journal_clear(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint8_t *buf;
+    size_t size;
+    int ret;
+
+    if (!s->refblock_journal_offset || s->nb_refblock_journal == 0) {
+        return 0;
+    }
+
+    size = s->nb_refblock_journal * sizeof(uint64_t);
+    buf = g_malloc0(size);
+    ret = bdrv_pwrite(bs->file, s->refblock_journal_offset, buf, size);
+    g_free(buf);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->nb_refblock_journal = 0;
+    return 0;
+}
+
 /* XXX: cache several refcount block clusters ? */
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
     int64_t offset, int64_t length, int addend)
@@ -463,6 +665,11 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                 }
             }
 
+            ret = refblock_journal_add(bs, table_index);
+            if (ret < 0) {
+                goto fail;
+            }
+
             ret = alloc_refcount_block(bs, cluster_index, &refcount_block);
             if (ret < 0) {
                 goto fail;
@@ -703,6 +910,8 @@ void qcow2_free_any_clusters(BlockDriverState *bs,
             int nb_csectors;
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
+            /* the host offset may be reused for something else now */
+            qcow2_compressed_cache_invalidate(bs);
             qcow2_free_clusters(bs,
                 (l2_entry & s->cluster_offset_mask) & ~511,
                 nb_csectors * 512);
@@ -781,6 +990,9 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                     if (offset & QCOW_OFLAG_COMPRESSED) {
                         nb_csectors = ((offset >> s->csize_shift) &
                                        s->csize_mask) + 1;
+                        if (addend < 0) {
+                            qcow2_compressed_cache_invalidate(bs);
+                        }
                         if (addend != 0) {
                             int ret;
                             ret = update_refcount(bs,
@@ -1136,38 +1348,28 @@ fail:
 }
 
 /*
- * Checks an image for refcount consistency.
- *
- * Returns 0 if no errors are found, the number of errors in case the image is
- * detected as corrupted, and -errno when an internal error occurred.
+ * Calculates the expected refcounts of all clusters by walking the image
+ * metadata. l1_flags are passed to check_refcounts_l1() for the active L1
+ * table.
  */
-int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
-                          BdrvCheckMode fix)
+static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                               uint16_t *refcount_table, int nb_clusters,
+                               int l1_flags)
 {
     BDRVQcowState *s = bs->opaque;
-    int64_t size, i, highest_cluster;
-    int nb_clusters, refcount1, refcount2;
     QCowSnapshot *sn;
-    uint16_t *refcount_table;
+    int64_t i;
     int ret;
 
-    size = bdrv_getlength(bs->file);
-    nb_clusters = size_to_clusters(s, size);
-    refcount_table = g_malloc0(nb_clusters * sizeof(uint16_t));
-
-    res->bfi.total_clusters =
-        size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
-
     /* header */
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         0, s->cluster_size);
 
     /* current L1 table */
     ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                             s->l1_table_offset, s->l1_size,
-                             CHECK_OFLAG_COPIED | CHECK_FRAG_INFO);
+                             s->l1_table_offset, s->l1_size, l1_flags);
     if (ret < 0) {
-        goto fail;
+        return ret;
     }
 
     /* snapshots */
@@ -1176,12 +1378,18 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
             sn->l1_table_offset, sn->l1_size, 0);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     }
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->snapshots_offset, s->snapshots_size);
 
+    /* refcount block journal */
+    if (s->refblock_journal_offset) {
+        inc_refcounts(bs, res, refcount_table, nb_clusters,
+            s->refblock_journal_offset, s->cluster_size);
+    }
+
     /* refcount data */
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->refcount_table_offset,
@@ -1219,8 +1427,24 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    /* compare ref counts */
-    for (i = 0, highest_cluster = 0; i < nb_clusters; i++) {
+    return 0;
+}
+
+/*
+ * Compares the refcounts of clusters [start, end) with the calculated ones
+ * and repairs them as far as fix allows. *highest_cluster is raised to the
+ * last cluster in the range that is in use.
+ */
+static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                              BdrvCheckMode fix, uint16_t *refcount_table,
+                              int64_t start, int64_t end,
+                              int64_t *highest_cluster)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t i;
+    int refcount1, refcount2, ret;
+
+    for (i = start; i < end; i++) {
         refcount1 = get_refcount(bs, i);
         if (refcount1 < 0) {
             fprintf(stderr, "Can't get refcount for cluster %" PRId64 ": %s\n",
@@ -1232,7 +1456,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         refcount2 = refcount_table[i];
 
         if (refcount1 > 0 || refcount2 > 0) {
-            highest_cluster = i;
+            *highest_cluster = i;
         }
 
         if (refcount1 != refcount2) {
@@ -1268,6 +1492,40 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             }
         }
     }
+}
+
+/*
+ * Checks an image for refcount consistency.
+ *
+ * Returns 0 if no errors are found, the number of errors in case the image is
+ * detected as corrupted, and -errno when an internal error occurred.
+ */
+int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                          BdrvCheckMode fix)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t size, highest_cluster;
+    int nb_clusters;
+    uint16_t *refcount_table;
+    int ret;
+
+    size = bdrv_getlength(bs->file);
+    nb_clusters = size_to_clusters(s, size);
+    refcount_table = g_malloc0(nb_clusters * sizeof(uint16_t));
+
+    res->bfi.total_clusters =
+        size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
+
+    ret = calculate_refcounts(bs, res, refcount_table, nb_clusters,
+                              CHECK_OFLAG_COPIED | CHECK_FRAG_INFO);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* compare ref counts */
+    highest_cluster = 0;
+    compare_refcounts(bs, res, fix, refcount_table, 0, nb_clusters,
+                      &highest_cluster);
 
     res->image_end_offset = (highest_cluster + 1) * s->cluster_size;
     ret = 0;
@@ -1278,3 +1536,47 @@ fail:
     return ret;
 }
 
+/*
+ * Like qcow2_check_refcounts(), but only compares the clusters covered by the
+ * refcount blocks in the refcount block journal, which are the only ones that
+ * can be stale after a crash with lazy refcounts. The journal must not have
+ * overflowed.
+ */
+int qcow2_check_journaled_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                    BdrvCheckMode fix)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t size, highest_cluster;
+    int nb_clusters, i;
+    uint16_t *refcount_table;
+    int ret;
+
+    assert(s->nb_refblock_journal < s->refblock_journal_slots);
+
+    size = bdrv_getlength(bs->file);
+    nb_clusters = size_to_clusters(s, size);
+    refcount_table = g_malloc0(nb_clusters * sizeof(uint16_t));
+
+    ret = calculate_refcounts(bs, res, refcount_table, nb_clusters, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    highest_cluster = 0;
+    for (i = 0; i < s->nb_refblock_journal; i++) {
+        int64_t start = s->refblock_journal[i] <<
+                        (s->cluster_bits - REFCOUNT_SHIFT);
+        int64_t end = start + (1 << (s->cluster_bits - REFCOUNT_SHIFT));
+
+        compare_refcounts(bs, res, fix, refcount_table,
+                          MIN(start, nb_clusters), MIN(end, nb_clusters),
+                          &highest_cluster);
+    }
+    ret = 0;
+
+fail:
+    g_free(refcount_table);
+
+    return ret;
+}
+
@@ -27,9 +27,11 @@
 #include <zlib.h>
 #include "qemu/aes.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qbool.h"
+#include "qapi/qmp/qint.h"
 #include "trace.h"
 
 /*
@@ -57,6 +59,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_REFBLOCK_JOURNAL 0x52424a4e
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -149,6 +152,23 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_REFBLOCK_JOURNAL:
+            if (ext.len != sizeof(uint64_t)) {
+                error_report("Invalid refcount block journal extension");
+                return -EINVAL;
+            }
+            ret = bdrv_pread(bs->file, offset, &s->refblock_journal_offset,
+                             ext.len);
+            if (ret < 0) {
+                return ret;
+            }
+            be64_to_cpus(&s->refblock_journal_offset);
+            if (s->refblock_journal_offset & (s->cluster_size - 1)) {
+                /* Ignore the journal, the image gets a full check instead */
+                s->refblock_journal_offset = 0;
+            }
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -252,26 +272,126 @@ int qcow2_mark_dirty(BlockDriverState *bs)
 }
 
 /*
- * Clears the dirty bit and flushes before if necessary.  Only call this
- * function when there are no pending requests, it does not guard against
- * concurrent requests dirtying the image.
+ * Clears the dirty bit and the refcount block journal and flushes before if
+ * necessary.  Only call this function when there are no pending requests, it
+ * does not guard against concurrent requests dirtying the image.
  */
 static int qcow2_mark_clean(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
 
-    if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
+    if ((s->incompatible_features & QCOW2_INCOMPAT_DIRTY) ||
+        s->nb_refblock_journal)
+    {
         int ret = bdrv_flush(bs);
         if (ret < 0) {
             return ret;
         }
 
+        ret = qcow2_refblock_journal_clear(bs);
+        if (ret < 0) {
+            return ret;
+        }
+
         s->incompatible_features &= ~QCOW2_INCOMPAT_DIRTY;
         return qcow2_update_header(bs);
     }
     return 0;
 }
 
+/*
+ * Writes back postponed refcount updates and marks the image clean, so that
+ * a crash while the image is idle doesn't require a repair on the next open.
+ * Requests may continue to run; the next allocation dirties the image again.
+ */
+static void coroutine_fn qcow2_refcount_flush_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+    uint64_t val;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_co_flush(bs->file);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = qcow2_refblock_journal_clear(bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Only the dirty bit changes, leave the rest of the header alone */
+    if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
+        val = cpu_to_be64(s->incompatible_features & ~QCOW2_INCOMPAT_DIRTY);
+        ret = bdrv_pwrite(bs->file,
+                          offsetof(QCowHeader, incompatible_features),
+                          &val, sizeof(val));
+        if (ret >= 0) {
+            s->incompatible_features &= ~QCOW2_INCOMPAT_DIRTY;
+        }
+    }
+
+out:
+    if (ret < 0) {
+        error_report("qcow2: Writing back refcounts of %s failed: %s",
+                     bs->filename, strerror(-ret));
+    }
+    qemu_co_mutex_unlock(&s->lock);
+    s->refcount_flush_co = NULL;
+
+    /* The image is still dirty, try again later */
+    if (ret < 0) {
+        qemu_mod_timer(s->refcount_flush_timer,
+                       qemu_get_clock_ms(vm_clock) +
+                       REFCOUNT_FLUSH_INTERVAL_MS);
+    }
+}
+
+static void qcow2_refcount_flush_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->refcount_flush_co) {
+        return;
+    }
+
+    s->refcount_flush_co = qemu_coroutine_create(qcow2_refcount_flush_entry);
+    qemu_coroutine_enter(s->refcount_flush_co, bs);
+}
+
+/*
+ * Stops the background refcount write-back, waiting for one that is already
+ * running.  The caller writes back everything itself afterwards.
+ */
+static void qcow2_refcount_flush_cancel(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (!s->refcount_flush_timer) {
+        return;
+    }
+    qemu_del_timer(s->refcount_flush_timer);
+    while (s->refcount_flush_co) {
+        qemu_aio_wait();
+    }
+    /* A failed write-back rearms the timer */
+    qemu_del_timer(s->refcount_flush_timer);
+    qemu_free_timer(s->refcount_flush_timer);
+    s->refcount_flush_timer = NULL;
+}
+
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
@@ -295,6 +415,16 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Postpone refcount updates",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum L2 table cache size",
+        },
+        {
+            .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum refcount block cache size",
+        },
         { /* end of list */ }
     },
 };
@@ -308,6 +438,8 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     Error *local_err = NULL;
     uint64_t ext_end;
     uint64_t l1_vm_state_index;
+    uint64_t l2_cache_tables, refcount_cache_tables;
+    bool stale_journal = false;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -453,15 +585,48 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
         }
     }
 
+    /* Enable lazy_refcounts according to image and command line options */
+    opts = qemu_opts_create_nofail(&qcow2_runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        qemu_opts_del(opts);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
+        (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
+    s->l2_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_SIZE,
+        (uint64_t)L2_CACHE_SIZE << s->cluster_bits);
+    s->refcount_cache_size = qemu_opt_get_size(opts,
+        QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+        (uint64_t)REFCOUNT_CACHE_SIZE << s->cluster_bits);
+
+    qemu_opts_del(opts);
+
+    if (s->use_lazy_refcounts && s->qcow_version < 3) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR, "Lazy refcounts require "
+            "a qcow2 image with at least qemu 1.1 compatibility level");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
-
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_blockalign(bs, QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
-                                  + 512);
-    s->cluster_cache_offset = -1;
+    l2_cache_tables = MAX(s->l2_cache_size >> s->cluster_bits,
+                          MIN_L2_CACHE_SIZE);
+    refcount_cache_tables = MAX(s->refcount_cache_size >> s->cluster_bits,
+                                MIN_REFCOUNT_CACHE_SIZE);
+    if (l2_cache_tables > INT_MAX || refcount_cache_tables > INT_MAX) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR, "qcow2 cache size too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_tables);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_tables);
+
+    qcow2_compressed_cache_invalidate(bs);
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -497,14 +662,31 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     }
 
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && s->autoclear_features != 0) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             goto fail;
         }
     }
 
+    /*
+     * The journal can only be trusted if the image was last written by an
+     * implementation that maintains it (otherwise the autoclear bit is gone),
+     * and it is only needed for repairing the image.
+     */
+    s->refblock_journal_slots = MIN(REFBLOCK_JOURNAL_MAX,
+                                    s->cluster_size / sizeof(uint64_t));
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_REFBLOCK_JOURNAL)) {
+        stale_journal = s->refblock_journal_offset != 0;
+        s->refblock_journal_offset = 0;
+    } else if (s->refblock_journal_offset && !bs->read_only) {
+        ret = qcow2_refblock_journal_load(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
 
@@ -513,32 +695,62 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
         (s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
         BdrvCheckResult result = {0};
 
-        ret = qcow2_check(bs, &result, BDRV_FIX_ERRORS);
+        if (s->refblock_journal_offset &&
+            s->nb_refblock_journal < s->refblock_journal_slots)
+        {
+            /* Only the refcount blocks in the journal can be stale */
+            ret = qcow2_check_journaled_refcounts(bs, &result,
+                                                  BDRV_FIX_ERRORS);
+            if (ret == 0 && result.check_errors == 0 &&
+                result.corruptions == 0) {
+                ret = qcow2_mark_clean(bs);
+            }
+        } else {
+            ret = qcow2_check(bs, &result, BDRV_FIX_ERRORS);
+        }
         if (ret < 0) {
             goto fail;
         }
     }
 
-    /* Enable lazy_refcounts according to image and command line options */
-    opts = qemu_opts_create_nofail(&qcow2_runtime_opts);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (error_is_set(&local_err)) {
-        qerror_report_err(local_err);
-        error_free(local_err);
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
-        (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
+    /* Keep a refcount block journal exactly while refcounts are lazy */
+    if (!bs->read_only &&
+        !(s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
+        if (stale_journal && !(flags & BDRV_O_CHECK)) {
+            /*
+             * The old journal cluster is still allocated, unless the other
+             * writer repaired the image and freed or even reused it. Only a
+             * full check can tell, so let it free the cluster if it leaked.
+             */
+            BdrvCheckResult result = {0};
 
-    qemu_opts_del(opts);
+            ret = qcow2_check(bs, &result, BDRV_FIX_LEAKS);
+            if (ret < 0) {
+                goto fail;
+            }
+            /* Drop the stale header extension */
+            ret = qcow2_update_header(bs);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+        if (s->use_lazy_refcounts && !s->refblock_journal_offset) {
+            ret = qcow2_refblock_journal_enable(bs);
+        } else if (!s->use_lazy_refcounts && s->refblock_journal_offset) {
+            ret = qcow2_refblock_journal_disable(bs);
+        }
+        if (ret < 0) {
+            goto fail;
+        }
+    }
 
-    if (s->use_lazy_refcounts && s->qcow_version < 3) {
-        qerror_report(ERROR_CLASS_GENERIC_ERROR, "Lazy refcounts require "
-            "a qcow2 image with at least qemu 1.1 compatibility level");
-        ret = -EINVAL;
-        goto fail;
+    /*
+     * vm_clock stops with the VM, so the timer cannot fire on a migration
+     * source that has handed the image over
+     */
+    if (s->use_lazy_refcounts && !bs->read_only) {
+        s->refcount_flush_timer = qemu_new_timer_ms(vm_clock,
+            qcow2_refcount_flush_timer_cb, bs);
     }
 
 #ifdef DEBUG_ALLOC
@@ -558,8 +770,11 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    if (s->refcount_block_cache) {
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
+    }
+    qcow2_compressed_cache_destroy(bs);
+    qemu_vfree(s->zero_cluster);
     return ret;
 }
 
@@ -661,6 +876,7 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     uint64_t bytes_done = 0;
     QEMUIOVector hd_qiov;
     uint8_t *cluster_data = NULL;
+    uint8_t *decompressed;
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
@@ -715,14 +931,14 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            ret = qcow2_decompress_cluster(bs, cluster_offset,
+                                           &decompressed);
             if (ret < 0) {
                 goto fail;
             }
 
             qemu_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
+                decompressed + index_in_cluster * 512,
                 512 * cur_nr_sectors);
             break;
 
@@ -802,14 +1018,14 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     uint64_t bytes_done = 0;
     uint8_t *cluster_data = NULL;
     QCowL2Meta *l2meta = NULL;
+    int64_t write_sector;
+    int write_nr_sectors;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), sector_num,
                                  remaining_sectors);
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
     qemu_co_mutex_lock(&s->lock);
 
     while (remaining_sectors != 0) {
@@ -854,13 +1070,49 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                 cur_nr_sectors * 512);
         }
 
+        write_sector = (cluster_offset >> 9) + index_in_cluster;
+        write_nr_sectors = cur_nr_sectors;
+
+        /*
+         * If the COW regions of a single new allocation only need to be
+         * zero-filled, write them together with the guest data so that the
+         * first write to a cluster costs a single request.
+         */
+        if (l2meta != NULL && l2meta->next == NULL &&
+            l2meta->cow_from_zero && !l2meta->alloc_beyond_eof &&
+            l2meta->alloc_offset == cluster_offset &&
+            l2meta->cow_start.nb_sectors == index_in_cluster &&
+            l2meta->cow_end.offset ==
+                (index_in_cluster + cur_nr_sectors) * BDRV_SECTOR_SIZE)
+        {
+            int cow_start = l2meta->cow_start.nb_sectors;
+            int cow_end = l2meta->cow_end.nb_sectors;
+
+            if (!s->zero_cluster) {
+                s->zero_cluster = qemu_blockalign(bs, s->cluster_size);
+                memset(s->zero_cluster, 0, s->cluster_size);
+            }
+
+            qemu_iovec_reset(&hd_qiov);
+            if (cow_start) {
+                qemu_iovec_add(&hd_qiov, s->zero_cluster, cow_start * 512);
+            }
+            qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
+                cur_nr_sectors * 512);
+            if (cow_end) {
+                qemu_iovec_add(&hd_qiov, s->zero_cluster, cow_end * 512);
+            }
+
+            write_sector -= cow_start;
+            write_nr_sectors += cow_start + cow_end;
+            l2meta->cow_merged = true;
+        }
+
         qemu_co_mutex_unlock(&s->lock);
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-        trace_qcow2_writev_data(qemu_coroutine_self(),
-                                (cluster_offset >> 9) + index_in_cluster);
-        ret = bdrv_co_writev(bs->file,
-                             (cluster_offset >> 9) + index_in_cluster,
-                             cur_nr_sectors, &hd_qiov);
+        trace_qcow2_writev_data(qemu_coroutine_self(), write_sector);
+        ret = bdrv_co_writev(bs->file, write_sector, write_nr_sectors,
+                             &hd_qiov);
         qemu_co_mutex_lock(&s->lock);
         if (ret < 0) {
             goto fail;
@@ -919,6 +1171,9 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_refcount_flush_cancel(bs);
+
     g_free(s->l1_table);
 
     qcow2_cache_flush(bs, s->l2_table_cache);
@@ -932,8 +1187,8 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_compressed_cache_destroy(bs);
+    qemu_vfree(s->zero_cluster);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -958,11 +1213,16 @@ static void qcow2_invalidate_cache(BlockDriverState *bs)
         memcpy(&aes_decrypt_key, &s->aes_decrypt_key, sizeof(aes_decrypt_key));
     }
 
+    qcow2_refcount_flush_cancel(bs);
     qcow2_close(bs);
 
     options = qdict_new();
     qdict_put(options, QCOW2_OPT_LAZY_REFCOUNTS,
               qbool_from_int(s->use_lazy_refcounts));
+    qdict_put(options, QCOW2_OPT_L2_CACHE_SIZE,
+              qint_from_int(s->l2_cache_size));
+    qdict_put(options, QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+              qint_from_int(s->refcount_cache_size));
 
     memset(s, 0, sizeof(BDRVQcowState));
     qcow2_open(bs, options, flags);
@@ -1117,6 +1377,19 @@ int qcow2_update_header(BlockDriverState *bs)
     buf += ret;
     buflen -= ret;
 
+    /* Refcount block journal */
+    if (s->refblock_journal_offset) {
+        uint64_t journal_offset = cpu_to_be64(s->refblock_journal_offset);
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_REFBLOCK_JOURNAL,
+                             &journal_offset, sizeof(journal_offset), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -1261,6 +1534,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     BlockDriverState* bs;
     QCowHeader header;
     uint8_t* refcount_table;
+    QDict *open_options;
     int ret;
 
     ret = bdrv_create_file(filename, options);
@@ -1320,7 +1594,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
      */
     BlockDriver* drv = bdrv_find_format("qcow2");
     assert(drv != NULL);
-    ret = bdrv_open(bs, filename, NULL,
+    /* The refcounts are still empty, so this must not allocate a refcount
+     * block journal cluster; keep refcount updates eager for now */
+    open_options = qdict_new();
+    qdict_put(open_options, QCOW2_OPT_LAZY_REFCOUNTS, qbool_from_int(false));
+    ret = bdrv_open(bs, filename, open_options,
         BDRV_O_RDWR | BDRV_O_CACHE_WB | BDRV_O_NO_FLUSH, drv);
     if (ret < 0) {
         goto out;
@@ -1526,14 +1804,74 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
-/* XXX: put compressed sectors first, then all the cluster aligned
-   tables to avoid losing bytes in alignment */
+typedef struct Qcow2CompressData {
+    const uint8_t *buf;
+    uint8_t *out_buf;
+    int size;
+    int ret;            /* compressed length, -ENOSPC if incompressible */
+    int *in_flight;
+} Qcow2CompressData;
+
+/* Runs in a thread pool worker */
+static int qcow2_compress_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+    z_stream strm;
+    int ret, out_len;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = data->size;
+    strm.next_in = (uint8_t *)data->buf;
+    strm.avail_out = data->size;
+    strm.next_out = data->out_buf;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        deflateEnd(&strm);
+        return -EINVAL;
+    }
+    out_len = strm.next_out - data->out_buf;
+
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || out_len >= data->size) {
+        return -ENOSPC;
+    }
+    return out_len;
+}
+
+static void qcow2_compress_cb(void *opaque, int ret)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = ret;
+    (*data->in_flight)--;
+}
+
+/*
+ * Writes nb_sectors starting at the cluster aligned sector_num as compressed
+ * clusters. All clusters are deflated concurrently in the thread pool; they
+ * are then allocated and written in order so that the image stays laid out
+ * sequentially.
+ *
+ * XXX: put compressed sectors first, then all the cluster aligned
+ * tables to avoid losing bytes in alignment
+ */
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    Qcow2CompressData *jobs;
+    ThreadPool *pool;
+    int ret, i, nb_clusters, in_flight;
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
@@ -1546,73 +1884,82 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return 0;
     }
 
-    if (nb_sectors != s->cluster_sectors) {
-        ret = -EINVAL;
+    if (sector_num & (s->cluster_sectors - 1)) {
+        return -EINVAL;
+    }
+
+    if (nb_sectors & (s->cluster_sectors - 1)) {
+        uint8_t *pad_buf;
+        int padded_sectors;
 
         /* Zero-pad last write if image size is not cluster aligned */
-        if (sector_num + nb_sectors == bs->total_sectors &&
-            nb_sectors < s->cluster_sectors) {
-            uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
-            memset(pad_buf, 0, s->cluster_size);
-            memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
-            qemu_vfree(pad_buf);
+        if (sector_num + nb_sectors != bs->total_sectors) {
+            return -EINVAL;
         }
+        padded_sectors = (nb_sectors + s->cluster_sectors - 1) &
+                         ~(s->cluster_sectors - 1);
+        pad_buf = qemu_blockalign(bs, padded_sectors * BDRV_SECTOR_SIZE);
+        memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
+        memset(pad_buf + nb_sectors * BDRV_SECTOR_SIZE, 0,
+               (padded_sectors - nb_sectors) * BDRV_SECTOR_SIZE);
+        ret = qcow2_write_compressed(bs, sector_num, pad_buf, padded_sectors);
+        qemu_vfree(pad_buf);
         return ret;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    nb_clusters = nb_sectors / s->cluster_sectors;
+    jobs = g_new0(Qcow2CompressData, nb_clusters);
+    out_buf = g_malloc((size_t)nb_clusters * s->cluster_size);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    in_flight = 0;
+    for (i = 0; i < nb_clusters; i++) {
+        jobs[i] = (Qcow2CompressData) {
+            .buf        = buf + (size_t)i * s->cluster_size,
+            .out_buf    = out_buf + (size_t)i * s->cluster_size,
+            .size       = s->cluster_size,
+            .in_flight  = &in_flight,
+        };
+        in_flight++;
+        thread_pool_submit_aio(pool, qcow2_compress_func, &jobs[i],
+                               qcow2_compress_cb, &jobs[i]);
     }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
+    while (in_flight > 0) {
+        qemu_aio_wait();
     }
-    out_len = strm.next_out - out_buf;
 
-    deflateEnd(&strm);
+    for (i = 0; i < nb_clusters; i++) {
+        int64_t cur_sector = sector_num + (int64_t)i * s->cluster_sectors;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
-        }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
-        }
-        cluster_offset &= s->cluster_offset_mask;
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
+        ret = jobs[i].ret;
+        if (ret == -ENOSPC) {
+            /* could not compress: write normal cluster */
+            ret = bdrv_write(bs, cur_sector, jobs[i].buf, s->cluster_sectors);
+            if (ret < 0) {
+                goto fail;
+            }
+        } else if (ret < 0) {
             goto fail;
+        } else {
+            cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+                cur_sector << 9, ret);
+            if (!cluster_offset) {
+                ret = -EIO;
+                goto fail;
+            }
+            cluster_offset &= s->cluster_offset_mask;
+            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+            ret = bdrv_pwrite(bs->file, cluster_offset, jobs[i].out_buf, ret);
+            if (ret < 0) {
+                goto fail;
+            }
         }
     }
 
     ret = 0;
 fail:
     g_free(out_buf);
+    g_free(jobs);
     return ret;
 }
 
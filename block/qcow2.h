@@ -51,15 +51,33 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Cache sizes in tables; the defaults are overridden by the options below */
 #define L2_CACHE_SIZE 16
+#define MIN_L2_CACHE_SIZE 2
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
+#define MIN_REFCOUNT_CACHE_SIZE 4
+
+/* Number of decompressed clusters kept around for sequential readers */
+#define COMPRESSED_CACHE_SIZE 8
+
+/* Maximum number of refcount blocks tracked in the refcount block journal */
+#define REFBLOCK_JOURNAL_MAX 1024
+
+/* Refcount block journal entries: valid flag and refcount table index */
+#define REFBLOCK_JOURNAL_VALID      (1ULL << 63)
+#define REFBLOCK_JOURNAL_OVERFLOW   (~0ULL)
+
+/* Delay before postponed refcount updates are written back in the background */
+#define REFCOUNT_FLUSH_INTERVAL_MS 5000
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
 
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy_refcounts"
+#define QCOW2_OPT_L2_CACHE_SIZE "l2_cache_size"
+#define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount_cache_size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -129,12 +147,27 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_REFBLOCK_JOURNAL_BITNR = 0,
+    QCOW2_AUTOCLEAR_REFBLOCK_JOURNAL       =
+        1 << QCOW2_AUTOCLEAR_REFBLOCK_JOURNAL_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK                   = QCOW2_AUTOCLEAR_REFBLOCK_JOURNAL,
+};
+
 typedef struct Qcow2Feature {
     uint8_t type;
     uint8_t bit;
     char    name[46];
 } QEMU_PACKED Qcow2Feature;
 
+typedef struct Qcow2CompressedCacheEntry {
+    uint8_t *data;          /* one decompressed cluster, NULL if unused */
+    uint64_t offset;        /* host offset of the compressed data */
+    uint64_t lru_counter;
+} Qcow2CompressedCacheEntry;
+
 typedef struct BDRVQcowState {
     int cluster_bits;
     int cluster_size;
@@ -151,10 +184,13 @@ typedef struct BDRVQcowState {
 
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
+    uint64_t l2_cache_size;         /* in bytes, as requested on open */
+    uint64_t refcount_cache_size;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    Qcow2CompressedCacheEntry cluster_cache[COMPRESSED_CACHE_SIZE];
+    uint64_t cluster_cache_lru_counter;
+    uint64_t cluster_cache_generation;
+    uint8_t *zero_cluster;          /* zero-filled COW source, lazily allocated */
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -165,6 +201,14 @@ typedef struct BDRVQcowState {
 
     CoMutex lock;
 
+    /* Refcount blocks that may be stale on disk with lazy refcounts */
+    uint64_t refblock_journal_offset;   /* 0 if there is no journal */
+    int refblock_journal_slots;
+    int nb_refblock_journal;
+    uint64_t refblock_journal[REFBLOCK_JOURNAL_MAX];
+    QEMUTimer *refcount_flush_timer;
+    Coroutine *refcount_flush_co;
+
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
     AES_KEY aes_encrypt_key;
@@ -250,6 +294,22 @@ typedef struct QCowL2Meta
      */
     Qcow2COWRegion cow_end;
 
+    /**
+     * The old clusters read as zeroes (unallocated without a backing file, or
+     * zero clusters), so the COW regions are zero-filled instead of copied.
+     */
+    bool cow_from_zero;
+
+    /**
+     * The new clusters lie beyond the end of the image file at the time of
+     * allocation and already read as zeroes, so zero-filled COW regions
+     * don't need to be written at all.
+     */
+    bool alloc_beyond_eof;
+
+    /** The COW regions were written together with the guest data */
+    bool cow_merged;
+
     /** Pointer to next L2Meta of the same write request */
     struct QCowL2Meta *next;
 
@@ -358,12 +418,23 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                           BdrvCheckMode fix);
+int qcow2_check_journaled_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                    BdrvCheckMode fix);
+
+int qcow2_refblock_journal_load(BlockDriverState *bs);
+int qcow2_refblock_journal_enable(BlockDriverState *bs);
+int qcow2_refblock_journal_disable(BlockDriverState *bs);
+int qcow2_refblock_journal_clear(BlockDriverState *bs);
 
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          uint8_t **data);
+void qcow2_compressed_cache_invalidate(BlockDriverState *bs);
+void qcow2_compressed_cache_destroy(BlockDriverState *bs);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
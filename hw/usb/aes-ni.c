@@ -0,0 +1,263 @@
+/*
+ * AES-NI backend for the avrk aes128 cipher
+ *
+ * Copyright (c) 2014 Hao Fei.
+ *
+ * This code is licensed under the LGPL.
+ *
+ * This file is built with -maes, so nothing in here may run before
+ * AES128_aesni_available() has confirmed that the host supports it.
+ */
+
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "aes.h"
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+#define AESNI_ROUNDS 10
+
+/* independent blocks kept in flight to hide the AESENC/AESDEC latency */
+#define AESNI_LANES 4
+
+bool AES128_aesni_available(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (ecx & bit_AES) && (edx & bit_SSE2);
+}
+
+static inline __m128i aesni_load(const uint8_t *p)
+{
+    return _mm_loadu_si128((const __m128i *)p);
+}
+
+static inline void aesni_store(uint8_t *p, __m128i x)
+{
+    _mm_storeu_si128((__m128i *)p, x);
+}
+
+static void aesni_enc_keys(const AES128_ctx *ctx, __m128i *k)
+{
+    int i;
+
+    for (i = 0; i <= AESNI_ROUNDS; i++) {
+        k[i] = aesni_load(ctx->RoundKey + 16 * i);
+    }
+}
+
+/* AESDEC wants the equivalent inverse cipher schedule, last round first */
+static void aesni_dec_keys(const AES128_ctx *ctx, __m128i *k)
+{
+    int i;
+
+    for (i = 0; i <= AESNI_ROUNDS; i++) {
+        k[i] = aesni_load(ctx->InvRoundKey + 16 * (AESNI_ROUNDS - i));
+    }
+}
+
+static inline __m128i aesni_encrypt1(const __m128i *k, __m128i x)
+{
+    int i;
+
+    x = _mm_xor_si128(x, k[0]);
+    for (i = 1; i < AESNI_ROUNDS; i++) {
+        x = _mm_aesenc_si128(x, k[i]);
+    }
+    return _mm_aesenclast_si128(x, k[AESNI_ROUNDS]);
+}
+
+static inline __m128i aesni_decrypt1(const __m128i *k, __m128i x)
+{
+    int i;
+
+    x = _mm_xor_si128(x, k[0]);
+    for (i = 1; i < AESNI_ROUNDS; i++) {
+        x = _mm_aesdec_si128(x, k[i]);
+    }
+    return _mm_aesdeclast_si128(x, k[AESNI_ROUNDS]);
+}
+
+static inline void aesni_encrypt4(const __m128i *k, __m128i *x)
+{
+    int i;
+
+    x[0] = _mm_xor_si128(x[0], k[0]);
+    x[1] = _mm_xor_si128(x[1], k[0]);
+    x[2] = _mm_xor_si128(x[2], k[0]);
+    x[3] = _mm_xor_si128(x[3], k[0]);
+    for (i = 1; i < AESNI_ROUNDS; i++) {
+        x[0] = _mm_aesenc_si128(x[0], k[i]);
+        x[1] = _mm_aesenc_si128(x[1], k[i]);
+        x[2] = _mm_aesenc_si128(x[2], k[i]);
+        x[3] = _mm_aesenc_si128(x[3], k[i]);
+    }
+    x[0] = _mm_aesenclast_si128(x[0], k[AESNI_ROUNDS]);
+    x[1] = _mm_aesenclast_si128(x[1], k[AESNI_ROUNDS]);
+    x[2] = _mm_aesenclast_si128(x[2], k[AESNI_ROUNDS]);
+    x[3] = _mm_aesenclast_si128(x[3], k[AESNI_ROUNDS]);
+}
+
+static inline void aesni_decrypt4(const __m128i *k, __m128i *x)
+{
+    int i;
+
+    x[0] = _mm_xor_si128(x[0], k[0]);
+    x[1] = _mm_xor_si128(x[1], k[0]);
+    x[2] = _mm_xor_si128(x[2], k[0]);
+    x[3] = _mm_xor_si128(x[3], k[0]);
+    for (i = 1; i < AESNI_ROUNDS; i++) {
+        x[0] = _mm_aesdec_si128(x[0], k[i]);
+        x[1] = _mm_aesdec_si128(x[1], k[i]);
+        x[2] = _mm_aesdec_si128(x[2], k[i]);
+        x[3] = _mm_aesdec_si128(x[3], k[i]);
+    }
+    x[0] = _mm_aesdeclast_si128(x[0], k[AESNI_ROUNDS]);
+    x[1] = _mm_aesdeclast_si128(x[1], k[AESNI_ROUNDS]);
+    x[2] = _mm_aesdeclast_si128(x[2], k[AESNI_ROUNDS]);
+    x[3] = _mm_aesdeclast_si128(x[3], k[AESNI_ROUNDS]);
+}
+
+static void aesni_ecb_encrypt(const AES128_ctx *ctx, const uint8_t *in,
+                              uint8_t *out, size_t blocks)
+{
+    __m128i k[AESNI_ROUNDS + 1], x[AESNI_LANES];
+    int i;
+
+    aesni_enc_keys(ctx, k);
+    for (; blocks >= AESNI_LANES; blocks -= AESNI_LANES) {
+        for (i = 0; i < AESNI_LANES; i++) {
+            x[i] = aesni_load(in + 16 * i);
+        }
+        aesni_encrypt4(k, x);
+        for (i = 0; i < AESNI_LANES; i++) {
+            aesni_store(out + 16 * i, x[i]);
+        }
+        in += 16 * AESNI_LANES;
+        out += 16 * AESNI_LANES;
+    }
+    for (; blocks; blocks--, in += 16, out += 16) {
+        aesni_store(out, aesni_encrypt1(k, aesni_load(in)));
+    }
+}
+
+static void aesni_ecb_decrypt(const AES128_ctx *ctx, const uint8_t *in,
+                              uint8_t *out, size_t blocks)
+{
+    __m128i k[AESNI_ROUNDS + 1], x[AESNI_LANES];
+    int i;
+
+    aesni_dec_keys(ctx, k);
+    for (; blocks >= AESNI_LANES; blocks -= AESNI_LANES) {
+        for (i = 0; i < AESNI_LANES; i++) {
+            x[i] = aesni_load(in + 16 * i);
+        }
+        aesni_decrypt4(k, x);
+        for (i = 0; i < AESNI_LANES; i++) {
+            aesni_store(out + 16 * i, x[i]);
+        }
+        in += 16 * AESNI_LANES;
+        out += 16 * AESNI_LANES;
+    }
+    for (; blocks; blocks--, in += 16, out += 16) {
+        aesni_store(out, aesni_decrypt1(k, aesni_load(in)));
+    }
+}
+
+/* CBC encryption is inherently serial */
+static void aesni_cbc_encrypt(const AES128_ctx *ctx, uint8_t *iv,
+                              const uint8_t *in, uint8_t *out, size_t blocks)
+{
+    __m128i k[AESNI_ROUNDS + 1], chain;
+
+    aesni_enc_keys(ctx, k);
+    chain = aesni_load(iv);
+    for (; blocks; blocks--, in += 16, out += 16) {
+        chain = aesni_encrypt1(k, _mm_xor_si128(aesni_load(in), chain));
+        aesni_store(out, chain);
+    }
+    aesni_store(iv, chain);
+}
+
+static void aesni_cbc_decrypt(const AES128_ctx *ctx, uint8_t *iv,
+                              const uint8_t *in, uint8_t *out, size_t blocks)
+{
+    __m128i k[AESNI_ROUNDS + 1], x[AESNI_LANES], c[AESNI_LANES], chain;
+    int i;
+
+    aesni_dec_keys(ctx, k);
+    chain = aesni_load(iv);
+    for (; blocks >= AESNI_LANES; blocks -= AESNI_LANES) {
+        for (i = 0; i < AESNI_LANES; i++) {
+            c[i] = x[i] = aesni_load(in + 16 * i);
+        }
+        aesni_decrypt4(k, x);
+        for (i = 0; i < AESNI_LANES; i++) {
+            aesni_store(out + 16 * i, _mm_xor_si128(x[i], chain));
+            chain = c[i];
+        }
+        in += 16 * AESNI_LANES;
+        out += 16 * AESNI_LANES;
+    }
+    for (; blocks; blocks--, in += 16, out += 16) {
+        c[0] = aesni_load(in);
+        aesni_store(out, _mm_xor_si128(aesni_decrypt1(k, c[0]), chain));
+        chain = c[0];
+    }
+    aesni_store(iv, chain);
+}
+
+/* the counter is a 128 bit big-endian integer, kept as two host words */
+static inline __m128i aesni_ctr_block(uint64_t hi, uint64_t lo)
+{
+    return _mm_set_epi64x(bswap64(lo), bswap64(hi));
+}
+
+static inline void aesni_ctr_inc(uint64_t *hi, uint64_t *lo)
+{
+    if (++*lo == 0) {
+        ++*hi;
+    }
+}
+
+static void aesni_ctr_crypt(const AES128_ctx *ctx, uint8_t *ctr,
+                            const uint8_t *in, uint8_t *out, size_t blocks)
+{
+    __m128i k[AESNI_ROUNDS + 1], x[AESNI_LANES];
+    uint64_t hi = ldq_be_p(ctr), lo = ldq_be_p(ctr + 8);
+    int i;
+
+    aesni_enc_keys(ctx, k);
+    for (; blocks >= AESNI_LANES; blocks -= AESNI_LANES) {
+        for (i = 0; i < AESNI_LANES; i++) {
+            x[i] = aesni_ctr_block(hi, lo);
+            aesni_ctr_inc(&hi, &lo);
+        }
+        aesni_encrypt4(k, x);
+        for (i = 0; i < AESNI_LANES; i++) {
+            aesni_store(out + 16 * i,
+                        _mm_xor_si128(x[i], aesni_load(in + 16 * i)));
+        }
+        in += 16 * AESNI_LANES;
+        out += 16 * AESNI_LANES;
+    }
+    for (; blocks; blocks--, in += 16, out += 16) {
+        x[0] = aesni_encrypt1(k, aesni_ctr_block(hi, lo));
+        aesni_store(out, _mm_xor_si128(x[0], aesni_load(in)));
+        aesni_ctr_inc(&hi, &lo);
+    }
+    stq_be_p(ctr, hi);
+    stq_be_p(ctr + 8, lo);
+}
+
+const AES128_backend AES128_backend_aesni = {
+    .name        = "aesni",
+    .ecb_encrypt = aesni_ecb_encrypt,
+    .ecb_decrypt = aesni_ecb_decrypt,
+    .cbc_encrypt = aesni_cbc_encrypt,
+    .cbc_decrypt = aesni_cbc_decrypt,
+    .ctr_crypt   = aesni_ctr_crypt,
+};
@@ -36,7 +36,9 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 /*****************************************************************************/
 /* Includes:                                                                 */
 /*****************************************************************************/
+#include "config-host.h"
 #include <stdint.h>
+#include <string.h>
 #include "aes.h"
 
 
@@ -56,16 +58,8 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 /*****************************************************************************/
 /* Private variables:                                                        */
 /*****************************************************************************/
-// in    - pointer to the CipherText to be decrypted.
-// out   - pointer to buffer to hold output of the decryption.
-// state - array holding the intermediate results during decryption.
-static uint8_t* in, *out, state[4][4];
-
-// The array that stores the round keys.
-static uint8_t RoundKey[176];
-
-// The Key input to the AES Program
-static uint8_t* Key;
+// state - array holding the intermediate results during en/decryption.
+typedef uint8_t state_t[4][4];
 
 // The lookup-tables are marked const so they can be placed in read-only storage instead of RAM
 // The numbers below can be computed dynamically trading ROM for RAM - 
@@ -145,7 +139,7 @@ static uint8_t getSBoxInvert(uint8_t num)
 
 
 // This function produces Nb(Nr+1) round keys. The round keys are used in each round to decrypt the states. 
-static void KeyExpansion(void)
+static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key)
 {
   uint32_t i, j, k;
   uint8_t tempa[4]; // used for the column/row operations
@@ -212,28 +206,28 @@ static void KeyExpansion(void)
 
 // This function adds the round key to state.
 // The round key is added to the state by an XOR function.
-static void AddRoundKey(uint8_t round) 
+static void AddRoundKey(uint8_t round, state_t* state, const uint8_t* RoundKey)
 {
   uint8_t i,j;
   for(i=0;i<4;i++)
   {
     for(j = 0; j < 4; ++j)
     {
-      state[j][i] ^= RoundKey[round * Nb * 4 + i * Nb + j];
+      (*state)[j][i] ^= RoundKey[round * Nb * 4 + i * Nb + j];
     }
   }
 }
 
 // The SubBytes Function Substitutes the values in the
 // state matrix with values in an S-box.
-static void SubBytes(void)
+static void SubBytes(state_t* state)
 {
   uint8_t i, j;
   for(i = 0; i < 4; ++i)
   {
     for(j = 0; j < 4; ++j)
     {
-      state[i][j] = getSBoxValue(state[i][j]);
+      (*state)[i][j] = getSBoxValue((*state)[i][j]);
     }
   }
 }
@@ -241,32 +235,32 @@ static void SubBytes(void)
 // The ShiftRows() function shifts the rows in the state to the left.
 // Each row is shifted with different offset.
 // Offset = Row number. So the first row is not shifted.
-static void ShiftRows(void)
+static void ShiftRows(state_t* state)
 {
   uint8_t temp;
 
   // Rotate first row 1 columns to left  
-  temp        = state[1][0];
-  state[1][0] = state[1][1];
-  state[1][1] = state[1][2];
-  state[1][2] = state[1][3];
-  state[1][3] = temp;
+  temp        = (*state)[1][0];
+  (*state)[1][0] = (*state)[1][1];
+  (*state)[1][1] = (*state)[1][2];
+  (*state)[1][2] = (*state)[1][3];
+  (*state)[1][3] = temp;
 
   // Rotate second row 2 columns to left  
-  temp        = state[2][0];
-  state[2][0] = state[2][2];
-  state[2][2] = temp;
+  temp        = (*state)[2][0];
+  (*state)[2][0] = (*state)[2][2];
+  (*state)[2][2] = temp;
 
-  temp = state[2][1];
-  state[2][1] = state[2][3];
-  state[2][3] = temp;
+  temp = (*state)[2][1];
+  (*state)[2][1] = (*state)[2][3];
+  (*state)[2][3] = temp;
 
   // Rotate third row 3 columns to left
-  temp = state[3][0];
-  state[3][0] = state[3][3];
-  state[3][3] = state[3][2];
-  state[3][2] = state[3][1];
-  state[3][1] = temp;
+  temp = (*state)[3][0];
+  (*state)[3][0] = (*state)[3][3];
+  (*state)[3][3] = (*state)[3][2];
+  (*state)[3][2] = (*state)[3][1];
+  (*state)[3][1] = temp;
 }
 
 static uint8_t xtime(uint8_t x)
@@ -275,18 +269,18 @@ static uint8_t xtime(uint8_t x)
 }
 
 // MixColumns function mixes the columns of the state matrix
-static void MixColumns(void)
+static void MixColumns(state_t* state)
 {
   uint8_t i;
   uint8_t Tmp,Tm,t;
   for(i = 0; i < 4; ++i)
   {  
-    t   = state[0][i];
-    Tmp = state[0][i] ^ state[1][i] ^ state[2][i] ^ state[3][i] ;
-    Tm  = state[0][i] ^ state[1][i] ; Tm = xtime(Tm); state[0][i] ^= Tm ^ Tmp ;
-    Tm  = state[1][i] ^ state[2][i] ; Tm = xtime(Tm); state[1][i] ^= Tm ^ Tmp ;
-    Tm  = state[2][i] ^ state[3][i] ; Tm = xtime(Tm); state[2][i] ^= Tm ^ Tmp ;
-    Tm  = state[3][i] ^ t ; Tm = xtime(Tm); state[3][i] ^= Tm ^ Tmp ;
+    t   = (*state)[0][i];
+    Tmp = (*state)[0][i] ^ (*state)[1][i] ^ (*state)[2][i] ^ (*state)[3][i] ;
+    Tm  = (*state)[0][i] ^ (*state)[1][i] ; Tm = xtime(Tm); (*state)[0][i] ^= Tm ^ Tmp ;
+    Tm  = (*state)[1][i] ^ (*state)[2][i] ; Tm = xtime(Tm); (*state)[1][i] ^= Tm ^ Tmp ;
+    Tm  = (*state)[2][i] ^ (*state)[3][i] ; Tm = xtime(Tm); (*state)[2][i] ^= Tm ^ Tmp ;
+    Tm  = (*state)[3][i] ^ t ; Tm = xtime(Tm); (*state)[3][i] ^= Tm ^ Tmp ;
   }
 }
 
@@ -297,75 +291,76 @@ static void MixColumns(void)
 // MixColumns function mixes the columns of the state matrix.
 // The method used to multiply may be difficult to understand for the inexperienced.
 // Please use the references to gain more information.
-static void InvMixColumns(void)
+static void InvMixColumns(state_t* state)
 {
   int i;
   uint8_t a,b,c,d;
   for(i=0;i<4;i++)
   { 
   
-    a = state[0][i];
-    b = state[1][i];
-    c = state[2][i];
-    d = state[3][i];
+    a = (*state)[0][i];
+    b = (*state)[1][i];
+    c = (*state)[2][i];
+    d = (*state)[3][i];
 
     
-    state[0][i] = Multiply(a, 0x0e) ^ Multiply(b, 0x0b) ^ Multiply(c, 0x0d) ^ Multiply(d, 0x09);
-    state[1][i] = Multiply(a, 0x09) ^ Multiply(b, 0x0e) ^ Multiply(c, 0x0b) ^ Multiply(d, 0x0d);
-    state[2][i] = Multiply(a, 0x0d) ^ Multiply(b, 0x09) ^ Multiply(c, 0x0e) ^ Multiply(d, 0x0b);
-    state[3][i] = Multiply(a, 0x0b) ^ Multiply(b, 0x0d) ^ Multiply(c, 0x09) ^ Multiply(d, 0x0e);
+    (*state)[0][i] = Multiply(a, 0x0e) ^ Multiply(b, 0x0b) ^ Multiply(c, 0x0d) ^ Multiply(d, 0x09);
+    (*state)[1][i] = Multiply(a, 0x09) ^ Multiply(b, 0x0e) ^ Multiply(c, 0x0b) ^ Multiply(d, 0x0d);
+    (*state)[2][i] = Multiply(a, 0x0d) ^ Multiply(b, 0x09) ^ Multiply(c, 0x0e) ^ Multiply(d, 0x0b);
+    (*state)[3][i] = Multiply(a, 0x0b) ^ Multiply(b, 0x0d) ^ Multiply(c, 0x09) ^ Multiply(d, 0x0e);
   }
 }
 
 
 // The SubBytes Function Substitutes the values in the
 // state matrix with values in an S-box.
-static void InvSubBytes(void)
+static void InvSubBytes(state_t* state)
 {
   uint8_t i,j;
   for(i=0;i<4;i++)
   {
     for(j=0;j<4;j++)
     {
-      state[i][j] = getSBoxInvert(state[i][j]);
+      (*state)[i][j] = getSBoxInvert((*state)[i][j]);
     }
   }
 }
 
 
-static void InvShiftRows(void)
+static void InvShiftRows(state_t* state)
 {
   uint8_t temp;
 
   // Rotate first row 1 columns to right  
-  temp=state[1][3];
-  state[1][3]=state[1][2];
-  state[1][2]=state[1][1];
-  state[1][1]=state[1][0];
-  state[1][0]=temp;
+  temp=(*state)[1][3];
+  (*state)[1][3]=(*state)[1][2];
+  (*state)[1][2]=(*state)[1][1];
+  (*state)[1][1]=(*state)[1][0];
+  (*state)[1][0]=temp;
 
   // Rotate second row 2 columns to right 
-  temp=state[2][0];
-  state[2][0]=state[2][2];
-  state[2][2]=temp;
+  temp=(*state)[2][0];
+  (*state)[2][0]=(*state)[2][2];
+  (*state)[2][2]=temp;
 
-  temp=state[2][1];
-  state[2][1]=state[2][3];
-  state[2][3]=temp;
+  temp=(*state)[2][1];
+  (*state)[2][1]=(*state)[2][3];
+  (*state)[2][3]=temp;
 
   // Rotate third row 3 columns to right
-  temp=state[3][0];
-  state[3][0]=state[3][1];
-  state[3][1]=state[3][2];
-  state[3][2]=state[3][3];
-  state[3][3]=temp;
+  temp=(*state)[3][0];
+  (*state)[3][0]=(*state)[3][1];
+  (*state)[3][1]=(*state)[3][2];
+  (*state)[3][2]=(*state)[3][3];
+  (*state)[3][3]=temp;
 }
 
 
 // Cipher is the main function that encrypts the PlainText.
-static void Cipher(void)
+static void Cipher(const uint8_t* in, uint8_t* out, const uint8_t* RoundKey)
 {
   uint8_t i, j, round = 0;
+  state_t state;
 
   //Copy the input PlainText to state array.
   for(i = 0; i < 4; ++i)
@@ -377,24 +372,24 @@ static void Cipher(void)
   }
 
   // Add the First round key to the state before starting the rounds.
-  AddRoundKey(0); 
+  AddRoundKey(0, &state, RoundKey); 
   
   // There will be Nr rounds.
   // The first Nr-1 rounds are identical.
   // These Nr-1 rounds are executed in the loop below.
   for(round = 1; round < Nr; ++round)
   {
-    SubBytes();
-    ShiftRows();
-    MixColumns();
-    AddRoundKey(round);
+    SubBytes(&state);
+    ShiftRows(&state);
+    MixColumns(&state);
+    AddRoundKey(round, &state, RoundKey);
   }
   
   // The last round is given below.
   // The MixColumns function is not here in the last round.
-  SubBytes();
-  ShiftRows();
-  AddRoundKey(Nr);
+  SubBytes(&state);
+  ShiftRows(&state);
+  AddRoundKey(Nr, &state, RoundKey);
 
   // The encryption process is over.
   // Copy the state array to output array.
@@ -407,9 +402,10 @@ static void Cipher(void)
   }
 }
 
-static void InvCipher(void)
+static void InvCipher(const uint8_t* in, uint8_t* out, const uint8_t* RoundKey)
 {
   uint8_t i,j,round=0;
+  state_t state;
 
   //Copy the input CipherText to state array.
   for(i=0;i<4;i++)
@@ -421,24 +417,24 @@ static void InvCipher(void)
   }
 
   // Add the First round key to the state before starting the rounds.
-  AddRoundKey(Nr); 
+  AddRoundKey(Nr, &state, RoundKey); 
 
   // There will be Nr rounds.
   // The first Nr-1 rounds are identical.
   // These Nr-1 rounds are executed in the loop below.
   for(round=Nr-1;round>0;round--)
   {
-    InvShiftRows();
-    InvSubBytes();
-    AddRoundKey(round);
-    InvMixColumns();
+    InvShiftRows(&state);
+    InvSubBytes(&state);
+    AddRoundKey(round, &state, RoundKey);
+    InvMixColumns(&state);
   }
   
   // The last round is given below.
   // The MixColumns function is not here in the last round.
-  InvShiftRows();
-  InvSubBytes();
-  AddRoundKey(0);
+  InvShiftRows(&state);
+  InvSubBytes(&state);
+  AddRoundKey(0, &state, RoundKey);
 
   // The decryption process is over.
   // Copy the state array to output array.
@@ -452,33 +448,258 @@ static void InvCipher(void)
 }
 
 
+// Derive the round keys of the equivalent inverse cipher (FIPS-197 5.3.5):
+// the inner round keys with InvMixColumns applied.  This is the layout the
+// AES-NI AESDEC instruction expects.
+static void InvKeyExpansion(uint8_t* InvRoundKey, const uint8_t* RoundKey)
+{
+  uint8_t i, j, round;
+  state_t state;
+
+  memcpy(InvRoundKey, RoundKey, Nb * (Nr + 1) * 4);
+  for(round = 1; round < Nr; ++round)
+  {
+    for(i = 0; i < 4; ++i)
+    {
+      for(j = 0; j < 4; ++j)
+      {
+        state[j][i] = RoundKey[round * Nb * 4 + i * Nb + j];
+      }
+    }
+    InvMixColumns(&state);
+    for(i = 0; i < 4; ++i)
+    {
+      for(j = 0; j < 4; ++j)
+      {
+        InvRoundKey[round * Nb * 4 + i * Nb + j] = state[j][i];
+      }
+    }
+  }
+}
+
+static void XorBlock(uint8_t* out, const uint8_t* a, const uint8_t* b)
+{
+  uint8_t i;
+  for(i = 0; i < keyln; ++i)
+  {
+    out[i] = a[i] ^ b[i];
+  }
+}
+
+// Increment a 128 bit big-endian counter block, as in SP 800-38A B.1.
+static void IncrementCounter(uint8_t* ctr)
+{
+  int i;
+  for(i = keyln - 1; i >= 0; --i)
+  {
+    if(++ctr[i])
+    {
+      break;
+    }
+  }
+}
+
+
+/*****************************************************************************/
+/* Portable backend:                                                         */
+/*****************************************************************************/
+static void soft_ecb_encrypt(const AES128_ctx* ctx, const uint8_t* input, uint8_t* output, size_t blocks)
+{
+  for(; blocks; --blocks, input += keyln, output += keyln)
+  {
+    Cipher(input, output, ctx->RoundKey);
+  }
+}
+
+static void soft_ecb_decrypt(const AES128_ctx* ctx, const uint8_t* input, uint8_t* output, size_t blocks)
+{
+  for(; blocks; --blocks, input += keyln, output += keyln)
+  {
+    InvCipher(input, output, ctx->RoundKey);
+  }
+}
+
+static void soft_cbc_encrypt(const AES128_ctx* ctx, uint8_t* iv, const uint8_t* input, uint8_t* output, size_t blocks)
+{
+  uint8_t buf[keyln];
+
+  for(; blocks; --blocks, input += keyln, output += keyln)
+  {
+    XorBlock(buf, input, iv);
+    Cipher(buf, output, ctx->RoundKey);
+    memcpy(iv, output, keyln);
+  }
+}
+
+static void soft_cbc_decrypt(const AES128_ctx* ctx, uint8_t* iv, const uint8_t* input, uint8_t* output, size_t blocks)
+{
+  uint8_t next_iv[keyln];
+
+  for(; blocks; --blocks, input += keyln, output += keyln)
+  {
+    // input and output may alias, so save the ciphertext first
+    memcpy(next_iv, input, keyln);
+    InvCipher(input, output, ctx->RoundKey);
+    XorBlock(output, output, iv);
+    memcpy(iv, next_iv, keyln);
+  }
+}
+
+static void soft_ctr_crypt(const AES128_ctx* ctx, uint8_t* ctr, const uint8_t* input, uint8_t* output, size_t blocks)
+{
+  uint8_t keystream[keyln];
+
+  for(; blocks; --blocks, input += keyln, output += keyln)
+  {
+    Cipher(ctr, keystream, ctx->RoundKey);
+    XorBlock(output, input, keystream);
+    IncrementCounter(ctr);
+  }
+}
+
+const AES128_backend AES128_backend_soft = {
+  .name        = "soft",
+  .ecb_encrypt = soft_ecb_encrypt,
+  .ecb_decrypt = soft_ecb_decrypt,
+  .cbc_encrypt = soft_cbc_encrypt,
+  .cbc_decrypt = soft_cbc_decrypt,
+  .ctr_crypt   = soft_ctr_crypt,
+};
+
+// The backend used by the public functions, picked once at startup.
+static const AES128_backend* backend = &AES128_backend_soft;
+
+static void __attribute__((constructor)) AES128_select_backend(void)
+{
+#ifdef CONFIG_AES_NI
+  if(AES128_aesni_available())
+  {
+    backend = &AES128_backend_aesni;
+  }
+#endif
+}
+
+
 /*****************************************************************************/
 /* Public functions:                                                         */
 /*****************************************************************************/
 
-void AES128_ECB_encrypt(uint8_t* input, uint8_t* key, uint8_t *output)
+void AES128_init_ctx(AES128_ctx* ctx, const uint8_t* key)
 {
-  // Copy the Key and CipherText
-  Key = key;
-  in = input;
-  out = output;
+  // The key schedule only depends on the key, so it is expanded once here
+  // and reused for every block processed with this context.
+  KeyExpansion(ctx->RoundKey, key);
+  InvKeyExpansion(ctx->InvRoundKey, ctx->RoundKey);
+}
 
-  // The KeyExpansion routine must be called before encryption.
-  KeyExpansion();
+const AES128_backend* AES128_get_backend(void)
+{
+  return backend;
+}
 
-  // The next function call encrypts the PlainText with the Key using AES algorithm.
-  Cipher();
+void AES128_ECB_encrypt_ctx(const AES128_ctx* ctx, const uint8_t* input, uint8_t* output)
+{
+  backend->ecb_encrypt(ctx, input, output, 1);
 }
 
-void AES128_ECB_decrypt(uint8_t* input, uint8_t* key, uint8_t *output)
+void AES128_ECB_decrypt_ctx(const AES128_ctx* ctx, const uint8_t* input, uint8_t* output)
 {
-  Key = key;
-  in = input;
-  out = output;
+  backend->ecb_decrypt(ctx, input, output, 1);
+}
+
+void AES128_ECB_encrypt_blocks(const AES128_ctx* ctx, const uint8_t* input, uint8_t* output, size_t blocks)
+{
+  backend->ecb_encrypt(ctx, input, output, blocks);
+}
+
+void AES128_ECB_decrypt_blocks(const AES128_ctx* ctx, const uint8_t* input, uint8_t* output, size_t blocks)
+{
+  backend->ecb_decrypt(ctx, input, output, blocks);
+}
+
+void AES128_CBC_encrypt_blocks(const AES128_ctx* ctx, uint8_t* iv, const uint8_t* input, uint8_t* output, size_t blocks)
+{
+  backend->cbc_encrypt(ctx, iv, input, output, blocks);
+}
+
+void AES128_CBC_decrypt_blocks(const AES128_ctx* ctx, uint8_t* iv, const uint8_t* input, uint8_t* output, size_t blocks)
+{
+  backend->cbc_decrypt(ctx, iv, input, output, blocks);
+}
+
+void AES128_CTR_crypt_blocks(const AES128_ctx* ctx, uint8_t* ctr, const uint8_t* input, uint8_t* output, size_t blocks)
+{
+  backend->ctr_crypt(ctx, ctr, input, output, blocks);
+}
 
-  KeyExpansion();
+// Multiply the XTS tweak by the primitive element x of GF(2^128), using the
+// little-endian byte order of IEEE 1619.
+static void XtsNextTweak(uint8_t* tweak)
+{
+  uint8_t i, carry = tweak[keyln - 1] >> 7;
+
+  for(i = keyln - 1; i > 0; --i)
+  {
+    tweak[i] = (tweak[i] << 1) | (tweak[i - 1] >> 7);
+  }
+  tweak[0] = (tweak[0] << 1) ^ (carry * 0x87);
+}
+
+// XTS is ECB between two tweak whitening steps.  Tweaks for a run of blocks
+// are computed up front so that the backend can still work on many blocks
+// in parallel.
+#define XTS_CHUNK_BLOCKS 32
+
+static void XtsCrypt(const AES128_ctx* ctx, uint8_t* tweak, const uint8_t* input, uint8_t* output, size_t blocks,
+                     void (*ecb)(const AES128_ctx*, const uint8_t*, uint8_t*, size_t))
+{
+  uint8_t tweaks[XTS_CHUNK_BLOCKS * keyln];
+  size_t i, n;
+
+  while(blocks)
+  {
+    n = blocks < XTS_CHUNK_BLOCKS ? blocks : XTS_CHUNK_BLOCKS;
+    for(i = 0; i < n; ++i)
+    {
+      memcpy(tweaks + i * keyln, tweak, keyln);
+      XorBlock(output + i * keyln, input + i * keyln, tweak);
+      XtsNextTweak(tweak);
+    }
+    ecb(ctx, output, output, n);
+    for(i = 0; i < n; ++i)
+    {
+      XorBlock(output + i * keyln, output + i * keyln, tweaks + i * keyln);
+    }
+    input += n * keyln;
+    output += n * keyln;
+    blocks -= n;
+  }
+}
+
+void AES128_XTS_encrypt_blocks(const AES128_ctx* ctx, uint8_t* tweak, const uint8_t* input, uint8_t* output, size_t blocks)
+{
+  XtsCrypt(ctx, tweak, input, output, blocks, backend->ecb_encrypt);
+}
+
+void AES128_XTS_decrypt_blocks(const AES128_ctx* ctx, uint8_t* tweak, const uint8_t* input, uint8_t* output, size_t blocks)
+{
+  XtsCrypt(ctx, tweak, input, output, blocks, backend->ecb_decrypt);
+}
+
+void AES128_ECB_encrypt(uint8_t* input, uint8_t* key, uint8_t *output)
+{
+  AES128_ctx ctx;
+
+  AES128_init_ctx(&ctx, key);
+  AES128_ECB_encrypt_ctx(&ctx, input, output);
+}
+
+void AES128_ECB_decrypt(uint8_t* input, uint8_t* key, uint8_t *output)
+{
+  AES128_ctx ctx;
 
-  InvCipher();
+  AES128_init_ctx(&ctx, key);
+  AES128_ECB_decrypt_ctx(&ctx, input, output);
 }
 
 #endif //_AES_C_
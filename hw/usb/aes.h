@@ -1,8 +1,51 @@
 #ifndef _AES_H_
 #define _AES_H_
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+// Expanded key schedules: Nb * (Nr + 1) round key words each.  InvRoundKey
+// holds the schedule of the equivalent inverse cipher.
+typedef struct AES128_ctx {
+  uint8_t RoundKey[176];
+  uint8_t InvRoundKey[176];
+} AES128_ctx;
+
+// A cipher implementation working on whole 16-byte blocks.  The CBC and CTR
+// functions update iv/ctr in place, so consecutive calls continue the chain.
+// Input and output may be the same buffer.
+typedef struct AES128_backend {
+  const char* name;
+  void (*ecb_encrypt)(const AES128_ctx* ctx, const uint8_t* input, uint8_t* output, size_t blocks);
+  void (*ecb_decrypt)(const AES128_ctx* ctx, const uint8_t* input, uint8_t* output, size_t blocks);
+  void (*cbc_encrypt)(const AES128_ctx* ctx, uint8_t* iv, const uint8_t* input, uint8_t* output, size_t blocks);
+  void (*cbc_decrypt)(const AES128_ctx* ctx, uint8_t* iv, const uint8_t* input, uint8_t* output, size_t blocks);
+  void (*ctr_crypt)(const AES128_ctx* ctx, uint8_t* ctr, const uint8_t* input, uint8_t* output, size_t blocks);
+} AES128_backend;
+
+extern const AES128_backend AES128_backend_soft;
+// Only built with CONFIG_AES_NI, and only usable if AES128_aesni_available().
+extern const AES128_backend AES128_backend_aesni;
+bool AES128_aesni_available(void);
+
+// The fastest backend supported by the host CPU.
+const AES128_backend* AES128_get_backend(void);
+
+void AES128_init_ctx(AES128_ctx* ctx, const uint8_t* key);
+void AES128_ECB_encrypt_ctx(const AES128_ctx* ctx, const uint8_t* input, uint8_t* output);
+void AES128_ECB_decrypt_ctx(const AES128_ctx* ctx, const uint8_t* input, uint8_t* output);
+
+void AES128_ECB_encrypt_blocks(const AES128_ctx* ctx, const uint8_t* input, uint8_t* output, size_t blocks);
+void AES128_ECB_decrypt_blocks(const AES128_ctx* ctx, const uint8_t* input, uint8_t* output, size_t blocks);
+void AES128_CBC_encrypt_blocks(const AES128_ctx* ctx, uint8_t* iv, const uint8_t* input, uint8_t* output, size_t blocks);
+void AES128_CBC_decrypt_blocks(const AES128_ctx* ctx, uint8_t* iv, const uint8_t* input, uint8_t* output, size_t blocks);
+void AES128_CTR_crypt_blocks(const AES128_ctx* ctx, uint8_t* ctr, const uint8_t* input, uint8_t* output, size_t blocks);
+// XTS-AES-128 within one data unit.  @tweak must already be encrypted with
+// the tweak key; it is advanced in place for each block.
+void AES128_XTS_encrypt_blocks(const AES128_ctx* ctx, uint8_t* tweak, const uint8_t* input, uint8_t* output, size_t blocks);
+void AES128_XTS_decrypt_blocks(const AES128_ctx* ctx, uint8_t* tweak, const uint8_t* input, uint8_t* output, size_t blocks);
+
 void AES128_ECB_encrypt(uint8_t* input, uint8_t* key, uint8_t *output);
 void AES128_ECB_decrypt(uint8_t* input, uint8_t* key, uint8_t *output);
 
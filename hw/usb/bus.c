@@ -3,6 +3,7 @@
 #include "hw/qdev.h"
 #include "sysemu/sysemu.h"
 #include "monitor/monitor.h"
+#include "qmp-commands.h"
 #include "trace.h"
 
 static void usb_bus_dev_print(Monitor *mon, DeviceState *qdev, int indent);
@@ -75,6 +76,7 @@ void usb_bus_new(USBBus *bus, USBBusOps *ops, DeviceState *host)
     QTAILQ_INIT(&bus->free);
     QTAILQ_INIT(&bus->used);
     QTAILQ_INSERT_TAIL(&busses, bus, next);
+    bus->trace = g_new0(USBTraceRecord, USB_TRACE_RING_SIZE);
 }
 
 USBBus *usb_bus_find(int busnr)
@@ -595,6 +597,226 @@ void usb_info(Monitor *mon, const QDict *qdict)
     }
 }
 
+static UsbEndpointStats *usb_ep_stats(USBEndpoint *ep,
+                                      UsbEndpointDirection direction)
+{
+    UsbEndpointStats *info;
+    UsbLatencyBucketList *bucket, **tail;
+    int i;
+
+    info = g_new0(UsbEndpointStats, 1);
+    info->nr = ep->nr;
+    info->direction = direction;
+    info->packets = ep->stats.packets;
+    info->bytes = ep->stats.bytes;
+    info->async = ep->stats.async;
+    info->naks = ep->stats.naks;
+    info->errors = ep->stats.errors;
+
+    tail = &info->latency;
+    for (i = 0; i < USB_STATS_LATENCY_BUCKETS; i++) {
+        if (!ep->stats.latency[i]) {
+            continue;
+        }
+        bucket = g_new0(UsbLatencyBucketList, 1);
+        bucket->value = g_new0(UsbLatencyBucket, 1);
+        if (i < USB_STATS_LATENCY_BUCKETS - 1) {
+            bucket->value->has_below_us = true;
+            bucket->value->below_us = 1 << i;
+        }
+        bucket->value->count = ep->stats.latency[i];
+        *tail = bucket;
+        tail = &bucket->next;
+    }
+    return info;
+}
+
+static void usb_ep_stats_append(UsbEndpointStatsList ***tail, USBEndpoint *ep,
+                                UsbEndpointDirection direction)
+{
+    UsbEndpointStatsList *entry;
+
+    if (!ep->stats.packets && !ep->stats.naks) {
+        return;
+    }
+    entry = g_new0(UsbEndpointStatsList, 1);
+    entry->value = usb_ep_stats(ep, direction);
+    **tail = entry;
+    *tail = &entry->next;
+}
+
+UsbDeviceStatsList *qmp_query_usb_stats(Error **errp)
+{
+    UsbDeviceStatsList *head = NULL, **tail = &head, *entry;
+    UsbEndpointStatsList **ep_tail;
+    UsbDeviceStats *info;
+    USBBus *bus;
+    USBDevice *dev;
+    USBPort *port;
+    int i;
+
+    QTAILQ_FOREACH(bus, &busses, next) {
+        QTAILQ_FOREACH(port, &bus->used, next) {
+            dev = port->dev;
+            if (!dev) {
+                continue;
+            }
+            info = g_new0(UsbDeviceStats, 1);
+            info->bus = bus->busnr;
+            info->port = g_strdup(port->path);
+            info->addr = dev->addr;
+            info->product = g_strdup(dev->product_desc);
+            if (dev->qdev.id) {
+                info->has_id = true;
+                info->id = g_strdup(dev->qdev.id);
+            }
+
+            ep_tail = &info->endpoints;
+            usb_ep_stats_append(&ep_tail, &dev->ep_ctl,
+                                USB_ENDPOINT_DIRECTION_CONTROL);
+            for (i = 0; i < USB_MAX_ENDPOINTS; i++) {
+                usb_ep_stats_append(&ep_tail, &dev->ep_in[i],
+                                    USB_ENDPOINT_DIRECTION_IN);
+                usb_ep_stats_append(&ep_tail, &dev->ep_out[i],
+                                    USB_ENDPOINT_DIRECTION_OUT);
+            }
+
+            entry = g_new0(UsbDeviceStatsList, 1);
+            entry->value = info;
+            *tail = entry;
+            tail = &entry->next;
+        }
+    }
+    return head;
+}
+
+/* pcap export of the packet trace rings, see usb_trace_record() */
+
+#define PCAP_MAGIC              0xa1b2c3d4
+#define PCAP_LINKTYPE_USB_LINUX 189
+#define USBMON_HDR_LEN          48
+
+typedef struct USBTraceEntry {
+    USBTraceRecord *rec;
+    uint64_t seq;
+    int busnr;
+} USBTraceEntry;
+
+static int usb_trace_entry_cmp(const void *a, const void *b)
+{
+    const USBTraceEntry *ea = a, *eb = b;
+
+    if (ea->rec->ts != eb->rec->ts) {
+        return ea->rec->ts < eb->rec->ts ? -1 : 1;
+    }
+    if (ea->busnr != eb->busnr) {
+        return ea->busnr - eb->busnr;
+    }
+    return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+static void usb_trace_put_pcap(FILE *f, USBTraceEntry *e, int64_t offset)
+{
+    static const uint8_t xfer_type[] = {
+        [USB_ENDPOINT_XFER_CONTROL] = 2,
+        [USB_ENDPOINT_XFER_ISOC]    = 0,
+        [USB_ENDPOINT_XFER_BULK]    = 3,
+        [USB_ENDPOINT_XFER_INT]     = 1,
+    };
+    USBTraceRecord *rec = e->rec;
+    int64_t ts = rec->ts + offset;
+    uint8_t buf[16 + USBMON_HDR_LEN];
+    uint8_t *hdr = buf + 16;
+
+    memset(buf, 0, sizeof(buf));
+    /* pcap record header */
+    stl_le_p(buf, ts / 1000000000);
+    stl_le_p(buf + 4, (ts % 1000000000) / 1000);
+    stl_le_p(buf + 8, USBMON_HDR_LEN);
+    stl_le_p(buf + 12, USBMON_HDR_LEN + rec->length);
+    /* usbmon header, without any data */
+    stq_le_p(hdr, rec->id);
+    hdr[8] = rec->type;
+    hdr[9] = xfer_type[rec->xfer_type & 3];
+    hdr[10] = rec->epnum;
+    hdr[11] = rec->devnum;
+    stw_le_p(hdr + 12, e->busnr);
+    hdr[14] = '-';                      /* no setup packet */
+    hdr[15] = '<';                      /* no data */
+    stq_le_p(hdr + 16, ts / 1000000000);
+    stl_le_p(hdr + 24, (ts % 1000000000) / 1000);
+    stl_le_p(hdr + 28, rec->status);
+    stl_le_p(hdr + 32, rec->length);
+    stl_le_p(hdr + 36, 0);
+    fwrite(buf, 1, sizeof(buf), f);
+}
+
+void qmp_usb_trace_dump(const char *filename, bool has_bus, int64_t busnr,
+                        Error **errp)
+{
+    USBTraceEntry *entries;
+    USBBus *bus;
+    uint64_t first, seq;
+    size_t i, n = 0, max = 0;
+    uint8_t hdr[24];
+    int64_t offset;
+    FILE *f;
+
+    QTAILQ_FOREACH(bus, &busses, next) {
+        if (!has_bus || bus->busnr == busnr) {
+            max += MIN(bus->trace_count, USB_TRACE_RING_SIZE);
+        }
+    }
+    if (has_bus && usb_bus_find(busnr) == NULL) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "bus",
+                  "a USB bus number");
+        return;
+    }
+
+    f = fopen(filename, "wb");
+    if (!f) {
+        error_set(errp, QERR_OPEN_FILE_FAILED, filename);
+        return;
+    }
+
+    entries = g_new(USBTraceEntry, max + 1);
+    QTAILQ_FOREACH(bus, &busses, next) {
+        if (has_bus && bus->busnr != busnr) {
+            continue;
+        }
+        first = bus->trace_count > USB_TRACE_RING_SIZE ?
+                bus->trace_count - USB_TRACE_RING_SIZE : 0;
+        for (seq = first; seq < bus->trace_count; seq++) {
+            entries[n].rec = &bus->trace[seq % USB_TRACE_RING_SIZE];
+            entries[n].seq = seq;
+            entries[n].busnr = bus->busnr;
+            n++;
+        }
+    }
+    qsort(entries, n, sizeof(*entries), usb_trace_entry_cmp);
+
+    stl_le_p(hdr, PCAP_MAGIC);
+    stw_le_p(hdr + 4, 2);
+    stw_le_p(hdr + 6, 4);
+    stl_le_p(hdr + 8, 0);
+    stl_le_p(hdr + 12, 0);
+    stl_le_p(hdr + 16, 65535);
+    stl_le_p(hdr + 20, PCAP_LINKTYPE_USB_LINUX);
+    fwrite(hdr, 1, sizeof(hdr), f);
+
+    /* records carry get_clock() timestamps, convert them to wall time */
+    offset = get_clock_realtime() - get_clock();
+    for (i = 0; i < n; i++) {
+        usb_trace_put_pcap(f, &entries[i], offset);
+    }
+    g_free(entries);
+
+    if (ferror(f)) {
+        error_set(errp, QERR_IO_ERROR);
+    }
+    fclose(f);
+}
+
 /* handle legacy -usbdevice cmd line option */
 USBDevice *usbdevice_create(const char *cmdline)
 {
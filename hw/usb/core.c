@@ -26,6 +26,7 @@
 #include "qemu-common.h"
 #include "hw/usb.h"
 #include "qemu/iov.h"
+#include "qemu/timer.h"
 #include "trace.h"
 
 void usb_attach(USBPort *port)
@@ -376,8 +377,76 @@ static void usb_process_one(USBPacket *p)
     }
 }
 
+/* Linux errno values, which is what usbmon and its readers expect */
+#define USBMON_ENOENT       2
+#define USBMON_ENODEV       19
+#define USBMON_EPIPE        32
+#define USBMON_EPROTO       71
+#define USBMON_EOVERFLOW    75
+#define USBMON_EINPROGRESS  115
+
+static int32_t usb_trace_status(USBPacket *p)
+{
+    switch (p->status) {
+    case USB_RET_SUCCESS:
+        return 0;
+    case USB_RET_STALL:
+        return -USBMON_EPIPE;
+    case USB_RET_NODEV:
+        return -USBMON_ENODEV;
+    case USB_RET_BABBLE:
+        return -USBMON_EOVERFLOW;
+    default:
+        return -USBMON_EPROTO;
+    }
+}
+
+static void usb_trace_record(USBPacket *p, uint8_t type, int32_t status,
+                             uint32_t length)
+{
+    USBDevice *dev = p->ep->dev;
+    USBBus *bus = usb_bus_from_device(dev);
+    USBTraceRecord *rec;
+
+    rec = &bus->trace[bus->trace_count++ % USB_TRACE_RING_SIZE];
+    rec->id = (uintptr_t)p;
+    rec->ts = (type == 'S') ? p->submit_ns : get_clock();
+    rec->status = status;
+    rec->length = length;
+    rec->type = type;
+    rec->xfer_type = p->ep->type;
+    rec->epnum = p->ep->nr | (p->pid == USB_TOKEN_IN ? USB_DIR_IN : 0);
+    rec->devnum = dev->addr;
+}
+
+static void usb_trace_submit(USBPacket *p)
+{
+    usb_trace_record(p, 'S', -USBMON_EINPROGRESS, p->iov.size);
+}
+
+/* The device is done with @p: account it in its endpoint's statistics */
+static void usb_packet_account(USBPacket *p)
+{
+    USBEndpointStats *stats = &p->ep->stats;
+    int64_t us = (get_clock() - p->submit_ns) / 1000;
+    int bucket = 0;
+
+    stats->packets++;
+    stats->bytes += p->actual_length;
+    if (p->status != USB_RET_SUCCESS) {
+        stats->errors++;
+    }
+    while (us > 0 && bucket < USB_STATS_LATENCY_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    stats->latency[bucket]++;
+    usb_trace_record(p, 'C', usb_trace_status(p), p->actual_length);
+}
+
 static void usb_queue_one(USBPacket *p)
 {
+    usb_trace_submit(p);
     usb_packet_set_state(p, USB_PACKET_QUEUED);
     QTAILQ_INSERT_TAIL(&p->ep->queue, p, queue);
     p->status = USB_RET_ASYNC;
@@ -396,6 +465,7 @@ void usb_handle_packet(USBDevice *dev, USBPacket *p)
     assert(dev->state == USB_STATE_DEFAULT);
     usb_packet_check_state(p, USB_PACKET_SETUP);
     assert(p->ep != NULL);
+    p->submit_ns = get_clock();
 
     /* Submitting a new packet clears halt */
     if (p->ep->halted) {
@@ -411,6 +481,7 @@ void usb_handle_packet(USBDevice *dev, USBPacket *p)
             /* using async for interrupt packets breaks migration */
             assert(p->ep->type != USB_ENDPOINT_XFER_INT ||
                    (dev->flags & (1 << USB_DEV_FLAG_IS_HOST)));
+            usb_trace_submit(p);
             usb_packet_set_state(p, USB_PACKET_ASYNC);
             QTAILQ_INSERT_TAIL(&p->ep->queue, p, queue);
         } else if (p->status == USB_RET_ADD_TO_QUEUE) {
@@ -422,7 +493,11 @@ void usb_handle_packet(USBDevice *dev, USBPacket *p)
              */
             assert(!p->ep->pipeline || QTAILQ_EMPTY(&p->ep->queue));
             if (p->status != USB_RET_NAK) {
+                usb_trace_submit(p);
                 usb_packet_set_state(p, USB_PACKET_COMPLETE);
+                usb_packet_account(p);
+            } else {
+                p->ep->stats.naks++;
             }
         }
     } else {
@@ -443,6 +518,8 @@ void usb_packet_complete_one(USBDevice *dev, USBPacket *p)
     }
     usb_packet_set_state(p, USB_PACKET_COMPLETE);
     QTAILQ_REMOVE(&ep->queue, p, queue);
+    ep->stats.async++;
+    usb_packet_account(p);
     dev->port->ops->complete(dev->port, p);
 }
 
@@ -484,6 +561,7 @@ void usb_cancel_packet(USBPacket * p)
 {
     bool callback = (p->state == USB_PACKET_ASYNC);
     assert(usb_packet_is_inflight(p));
+    usb_trace_record(p, 'C', -USBMON_ENOENT, 0);
     usb_packet_set_state(p, USB_PACKET_CANCELED);
     QTAILQ_REMOVE(&p->ep->queue, p, queue);
     if (callback) {
@@ -561,6 +639,7 @@ void usb_packet_setup(USBPacket *p, int pid,
     p->short_not_ok = short_not_ok;
     p->int_req = int_req;
     p->combined = NULL;
+    p->sgl = NULL;
     qemu_iovec_reset(&p->iov);
     usb_packet_set_state(p, USB_PACKET_SETUP);
 }
@@ -11,6 +11,10 @@
 #include "hw/usb.h"
 #include "hw/usb/desc.h"
 #include "sysemu/char.h"
+#include "block/aio.h"
+#include "block/thread-pool.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
 #include "aes.h"
 #include <unistd.h>
 #include <string.h>
@@ -26,6 +30,78 @@ static size_t current_dir_length;
 #define VendorOutRequest ((USB_DIR_OUT|USB_TYPE_VENDOR|USB_RECIP_DEVICE)<<8)
 #define VendorInRequest ((USB_DIR_IN|USB_TYPE_VENDOR|USB_RECIP_DEVICE)<<8)
 
+#define AVRK_BLOCK_SIZE 16
+
+/* bulk streaming endpoints */
+#define AVRK_EP_STREAM_IN  1
+#define AVRK_EP_STREAM_OUT 2
+
+/*
+ * Ciphertext produced by the bulk OUT endpoint is queued until the guest
+ * reads it back.  Once this much is pending further OUT packets are NAKed,
+ * except that a single packet is always accepted into an empty queue so
+ * that oversized transfers still make progress.  Packets larger than
+ * AVRK_STREAM_PACKET_MAX are stalled, so the queue stays bounded.
+ */
+#define AVRK_STREAM_BUF_MAX    (1024 * 1024)
+#define AVRK_STREAM_PACKET_MAX (1024 * 1024)
+
+/*
+ * Key slots, selected by wIndex of REQ_CHANGE_KEY, REQ_START_ENCRYPT,
+ * REQ_START_DECRYPT and (for the bulk stream) REQ_STREAM_RESET.  Slot 0 is
+ * the key kept in the state file, the others only live in RAM.  Every slot
+ * keeps its expanded key schedule, so switching between them is free.
+ */
+#define AVRK_KEYSLOTS 8
+
+/* chaining modes of the bulk stream, selected with REQ_SET_MODE */
+enum {
+    AVRK_MODE_ECB,
+    AVRK_MODE_CBC,
+    AVRK_MODE_CTR,
+    AVRK_MODE_XTS,
+    AVRK_MODE_MAX,
+};
+
+/* REQ_SET_MODE wValue: low byte is the mode, this bit selects decryption */
+#define AVRK_MODE_DECRYPT 0x100
+
+/*
+ * Bulk OUT packets of at least offload-threshold bytes are processed on the
+ * thread pool, split into up to offload-jobs slices (by default one per host
+ * CPU, but no smaller than AVRK_OFFLOAD_SLICE_MIN) where the chaining mode
+ * allows it.
+ */
+#define AVRK_OFFLOAD_THRESHOLD 16384
+#define AVRK_OFFLOAD_SLICE_MIN 4096
+#define AVRK_OFFLOAD_JOBS_MAX  16
+
+/*
+ * How the state file backs AvrkDeviceState, selected with the persist
+ * property:
+ *   shared        the file is mapped MAP_SHARED, every store reaches it
+ *   volatile      the file is only read at startup, nothing is written back
+ *   writethrough  state lives in RAM, key and flash changes are written and
+ *                 synced immediately, LED and scratch buffers never are
+ *   periodic      state lives in RAM and is written back, if dirty, every
+ *                 persist-interval milliseconds and on unplug
+ */
+enum {
+    AVRK_PERSIST_SHARED,
+    AVRK_PERSIST_VOLATILE,
+    AVRK_PERSIST_WRITETHROUGH,
+    AVRK_PERSIST_PERIODIC,
+};
+
+static const char * const avrk_persist_names[] = {
+    [AVRK_PERSIST_SHARED]       = "shared",
+    [AVRK_PERSIST_VOLATILE]     = "volatile",
+    [AVRK_PERSIST_WRITETHROUGH] = "writethrough",
+    [AVRK_PERSIST_PERIODIC]     = "periodic",
+};
+
+#define AVRK_PERSIST_INTERVAL 1000
+
 #ifdef DEBUG_Avrk
 #define DPRINTF(fmt, ...) \
 do { printf("usb-avrk: " fmt , ## __VA_ARGS__); } while (0)
@@ -41,12 +117,83 @@ typedef struct {
     unsigned char flash;
 } AvrkDeviceState;
 
+/* how the bulk stream chains blocks, and how far it has got */
+typedef struct {
+    uint8_t mode;
+    bool decrypt;
+    /* CBC IV, CTR counter block or next XTS data unit number */
+    uint8_t iv[AVRK_BLOCK_SIZE];
+    /* XTS: current tweak, data unit size and blocks left in the unit */
+    uint8_t xts_tweak[AVRK_BLOCK_SIZE];
+    uint32_t xts_unit_blocks;
+    uint32_t xts_unit_left;
+} AvrkChain;
+
+typedef struct AvrkCryptRequest AvrkCryptRequest;
+
 typedef struct {
     USBDevice dev;
     char *filename;
     AvrkDeviceState *state;
+    /* keys of slots 1 and up (slot 0 is state->key), and all schedules */
+    uint8_t slot_keys[AVRK_KEYSLOTS][AVRK_BLOCK_SIZE];
+    AES128_ctx aes[AVRK_KEYSLOTS];
+
+    /* state file write-back, unused in the shared and volatile modes */
+    char *persist;
+    int persist_mode;
+    uint32_t persist_interval;
+    int fd;
+    bool persist_dirty;
+    QEMUTimer *persist_timer;
+
+    /* bulk stream: plaintext not yet forming a whole block */
+    uint8_t stream_block[AVRK_BLOCK_SIZE];
+    uint32_t stream_fill;
+    /* bulk stream: ciphertext waiting for the IN endpoint */
+    uint8_t *stream_buf;
+    uint32_t stream_start;
+    uint32_t stream_used;
+    uint32_t stream_size;
+    /* bulk stream: scratch copy of the current OUT packet */
+    uint8_t *stream_scratch;
+    uint32_t stream_scratch_size;
+
+    /* bulk stream: key slot, chaining mode and position, XTS tweak key */
+    uint8_t stream_slot;
+    AvrkChain chain;
+    uint8_t tweak_key[AVRK_BLOCK_SIZE];
+    AES128_ctx tweak_aes;
+
+    /* bulk stream: OUT packet being processed on the thread pool */
+    uint32_t offload_threshold;
+    uint32_t offload_jobs;
+    AvrkCryptRequest *crypt_req;
 } USBAvrkState;
 
+/* one slice of an offloaded packet, run on a thread pool worker */
+typedef struct {
+    AvrkCryptRequest *req;
+    AvrkChain chain;
+    uint8_t *buf;
+    uint32_t blocks;
+} AvrkCryptJob;
+
+struct AvrkCryptRequest {
+    USBAvrkState *s;
+    USBPacket *p;           /* NULL once the packet has been cancelled */
+    bool discard;           /* the stream was reset, drop the result */
+    /* the keys as they were when the packet arrived */
+    AES128_ctx aes;
+    AES128_ctx tweak_aes;
+    /* whole blocks of the packet, processed in place */
+    uint8_t *buf;
+    uint32_t blocks;
+    int njobs;
+    int pending;
+    AvrkCryptJob jobs[AVRK_OFFLOAD_JOBS_MAX];
+};
+
 enum {
     STR_MANUFACTURER = 1,
     STR_PRODUCT_SERIAL,
@@ -61,10 +208,40 @@ static const USBDescStrings desc_strings = {
 
 static const USBDescIface desc_iface0 = {
     .bInterfaceNumber              = 0,
-    .bNumEndpoints                 = 0,
+    .bNumEndpoints                 = 2,
     .bInterfaceClass               = USB_CLASS_VENDOR_SPEC,
     .bInterfaceSubClass            = USB_SUBCLASS_UNDEFINED,
     .bInterfaceProtocol            = 0x00,
+    .eps = (USBDescEndpoint[]) {
+        {
+            .bEndpointAddress      = USB_DIR_IN | AVRK_EP_STREAM_IN,
+            .bmAttributes          = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize        = 64,
+        },{
+            .bEndpointAddress      = USB_DIR_OUT | AVRK_EP_STREAM_OUT,
+            .bmAttributes          = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize        = 64,
+        },
+    }
+};
+
+static const USBDescIface desc_iface0_high = {
+    .bInterfaceNumber              = 0,
+    .bNumEndpoints                 = 2,
+    .bInterfaceClass               = USB_CLASS_VENDOR_SPEC,
+    .bInterfaceSubClass            = USB_SUBCLASS_UNDEFINED,
+    .bInterfaceProtocol            = 0x00,
+    .eps = (USBDescEndpoint[]) {
+        {
+            .bEndpointAddress      = USB_DIR_IN | AVRK_EP_STREAM_IN,
+            .bmAttributes          = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize        = 512,
+        },{
+            .bEndpointAddress      = USB_DIR_OUT | AVRK_EP_STREAM_OUT,
+            .bmAttributes          = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize        = 512,
+        },
+    }
 };
 
 static const USBDescDevice desc_device = {
@@ -83,6 +260,22 @@ static const USBDescDevice desc_device = {
     },
 };
 
+static const USBDescDevice desc_device_high = {
+    .bcdUSB                        = 0x0200,
+    .bMaxPacketSize0               = 64,
+    .bNumConfigurations            = 1,
+    .confs = (USBDescConfig[]) {
+        {
+            .bNumInterfaces        = 1,
+            .bConfigurationValue   = 1,
+            .bmAttributes          = 0x80,
+            .bMaxPower             = 25,
+            .nif = 1,
+            .ifs = &desc_iface0_high,
+        },
+    },
+};
+
 static const USBDesc desc_avrk = {
     .id = {
         .idVendor          = 0xf055,
@@ -93,6 +286,7 @@ static const USBDesc desc_avrk = {
         .iSerialNumber     = STR_SERIALNUMBER,
     },
     .full = &desc_device,
+    .high = &desc_device_high,
     .str  = desc_strings,
 };
 
@@ -110,38 +304,541 @@ enum Request {
     REQ_START_ENCRYPT,
     REQ_LED_CTL,
     REQ_CHANGE_KEY,
+    REQ_STREAM_RESET,
+    REQ_STREAM_FLUSH,
+    REQ_START_DECRYPT,
+    REQ_SET_MODE,
+    REQ_SET_IV,
+    REQ_CHANGE_TWEAK_KEY,
 };
 
+static void usb_avrk_stream_reset(USBAvrkState *s)
+{
+    s->stream_fill = 0;
+    s->stream_start = 0;
+    s->stream_used = 0;
+}
+
+/* make room for @len more bytes of ciphertext at the tail of the queue */
+static uint8_t *usb_avrk_stream_reserve(USBAvrkState *s, uint32_t len)
+{
+    if (s->stream_start + s->stream_used + len > s->stream_size) {
+        memmove(s->stream_buf, s->stream_buf + s->stream_start,
+                s->stream_used);
+        s->stream_start = 0;
+    }
+    if (s->stream_used + len > s->stream_size) {
+        s->stream_size = s->stream_used + len;
+        s->stream_buf = g_realloc(s->stream_buf, s->stream_size);
+    }
+    return s->stream_buf + s->stream_start + s->stream_used;
+}
+
+/* add @n to a little-endian 128 bit number */
+static void avrk_le_add(uint8_t *v, uint32_t n)
+{
+    uint32_t sum;
+    int i;
+
+    for (i = 0; i < AVRK_BLOCK_SIZE && n; i++) {
+        sum = v[i] + (n & 0xff);
+        v[i] = sum;
+        n = (n >> 8) + (sum >> 8);
+    }
+}
+
+/* add @n to a big-endian 128 bit number */
+static void avrk_be_add(uint8_t *v, uint32_t n)
+{
+    uint32_t sum;
+    int i;
+
+    for (i = AVRK_BLOCK_SIZE - 1; i >= 0 && n; i--) {
+        sum = v[i] + (n & 0xff);
+        v[i] = sum;
+        n = (n >> 8) + (sum >> 8);
+    }
+}
+
+/*
+ * Begin a new XTS data unit: encrypt its number (kept little-endian in
+ * c->iv) with the tweak key, then advance the number for the next one.
+ */
+static void avrk_xts_start_unit(const AES128_ctx *tweak_aes, AvrkChain *c)
+{
+    AES128_ECB_encrypt_ctx(tweak_aes, c->iv, c->xts_tweak);
+    avrk_le_add(c->iv, 1);
+    c->xts_unit_left = c->xts_unit_blocks ? c->xts_unit_blocks : UINT32_MAX;
+}
+
+/*
+ * Run whole blocks through the chaining mode, advancing @c.  This only
+ * touches its arguments, so it is safe to call from a worker thread.
+ */
+static void avrk_chain_blocks(const AES128_ctx *aes,
+                              const AES128_ctx *tweak_aes, AvrkChain *c,
+                              const uint8_t *in, uint8_t *out,
+                              uint32_t blocks)
+{
+    uint32_t n;
+
+    switch (c->mode) {
+    case AVRK_MODE_ECB:
+        if (c->decrypt) {
+            AES128_ECB_decrypt_blocks(aes, in, out, blocks);
+        } else {
+            AES128_ECB_encrypt_blocks(aes, in, out, blocks);
+        }
+        break;
+    case AVRK_MODE_CBC:
+        if (c->decrypt) {
+            AES128_CBC_decrypt_blocks(aes, c->iv, in, out, blocks);
+        } else {
+            AES128_CBC_encrypt_blocks(aes, c->iv, in, out, blocks);
+        }
+        break;
+    case AVRK_MODE_CTR:
+        AES128_CTR_crypt_blocks(aes, c->iv, in, out, blocks);
+        break;
+    case AVRK_MODE_XTS:
+        while (blocks) {
+            if (!c->xts_unit_left) {
+                avrk_xts_start_unit(tweak_aes, c);
+            }
+            n = MIN(blocks, c->xts_unit_left);
+            if (c->decrypt) {
+                AES128_XTS_decrypt_blocks(aes, c->xts_tweak, in, out, n);
+            } else {
+                AES128_XTS_encrypt_blocks(aes, c->xts_tweak, in, out, n);
+            }
+            c->xts_unit_left -= n;
+            in += n * AVRK_BLOCK_SIZE;
+            out += n * AVRK_BLOCK_SIZE;
+            blocks -= n;
+        }
+        break;
+    }
+}
+
+static void usb_avrk_stream_blocks(USBAvrkState *s, const uint8_t *in,
+                                   uint8_t *out, uint32_t blocks)
+{
+    avrk_chain_blocks(&s->aes[s->stream_slot], &s->tweak_aes, &s->chain,
+                      in, out, blocks);
+}
+
+/* process @len bytes of input, carrying any partial block over */
+static void usb_avrk_stream_process(USBAvrkState *s, const uint8_t *in,
+                                    uint32_t len)
+{
+    uint32_t n;
+    uint8_t *out;
+
+    out = usb_avrk_stream_reserve(s, (s->stream_fill + len) &
+                                     ~(AVRK_BLOCK_SIZE - 1));
+
+    if (s->stream_fill) {
+        n = MIN(AVRK_BLOCK_SIZE - s->stream_fill, len);
+        memcpy(s->stream_block + s->stream_fill, in, n);
+        s->stream_fill += n;
+        in += n;
+        len -= n;
+        if (s->stream_fill < AVRK_BLOCK_SIZE) {
+            return;
+        }
+        usb_avrk_stream_blocks(s, s->stream_block, out, 1);
+        out += AVRK_BLOCK_SIZE;
+        s->stream_used += AVRK_BLOCK_SIZE;
+        s->stream_fill = 0;
+    }
+
+    n = len & ~(AVRK_BLOCK_SIZE - 1);
+    usb_avrk_stream_blocks(s, in, out, n / AVRK_BLOCK_SIZE);
+    s->stream_used += n;
+    in += n;
+    len -= n;
+
+    memcpy(s->stream_block, in, len);
+    s->stream_fill = len;
+}
+
+/*
+ * Zero-pad and process a trailing partial block, if there is one.  CTR is a
+ * stream cipher, so there only the bytes actually written are returned.
+ */
+static void usb_avrk_stream_flush(USBAvrkState *s)
+{
+    uint8_t *out;
+
+    if (!s->stream_fill) {
+        return;
+    }
+    memset(s->stream_block + s->stream_fill, 0,
+           AVRK_BLOCK_SIZE - s->stream_fill);
+    out = usb_avrk_stream_reserve(s, AVRK_BLOCK_SIZE);
+    usb_avrk_stream_blocks(s, s->stream_block, out, 1);
+    if (s->chain.mode == AVRK_MODE_CTR) {
+        s->stream_used += s->stream_fill;
+    } else {
+        s->stream_used += AVRK_BLOCK_SIZE;
+    }
+    s->stream_fill = 0;
+}
+
+static int usb_avrk_crypt_worker(void *opaque)
+{
+    AvrkCryptJob *job = opaque;
+    AvrkCryptRequest *req = job->req;
+
+    avrk_chain_blocks(&req->aes, &req->tweak_aes, &job->chain,
+                      job->buf, job->buf, job->blocks);
+    return 0;
+}
+
+static void usb_avrk_crypt_complete(void *opaque, int ret)
+{
+    AvrkCryptJob *job = opaque;
+    AvrkCryptRequest *req = job->req;
+    USBAvrkState *s = req->s;
+    USBPacket *p = req->p;
+    uint32_t len = req->blocks * AVRK_BLOCK_SIZE;
+
+    if (--req->pending) {
+        return;
+    }
+
+    /*
+     * The data was taken from the packet at submission, so the stream
+     * moves on even if the packet has been cancelled since.  The next
+     * queued packet may start a new request from within complete.
+     */
+    s->crypt_req = NULL;
+    if (!req->discard) {
+        s->chain = req->jobs[req->njobs - 1].chain;
+        memcpy(usb_avrk_stream_reserve(s, len), req->buf, len);
+        s->stream_used += len;
+    }
+    if (p) {
+        p->status = USB_RET_SUCCESS;
+        usb_packet_complete(&s->dev, p);
+    }
+    g_free(req->buf);
+    g_free(req);
+}
+
+/*
+ * Split @req into slices that can be processed independently, and work out
+ * the chaining state each slice starts from.
+ */
+static void usb_avrk_crypt_split(USBAvrkState *s, AvrkCryptRequest *req)
+{
+    const AvrkChain *c = &s->chain;
+    uint32_t slice, start;
+    bool parallel;
+    int i;
+
+    switch (c->mode) {
+    case AVRK_MODE_CBC:
+        parallel = c->decrypt;
+        break;
+    case AVRK_MODE_XTS:
+        /* slices must begin on a data unit boundary */
+        parallel = c->xts_unit_blocks && !c->xts_unit_left;
+        break;
+    default:
+        parallel = true;
+        break;
+    }
+
+    req->njobs = 1;
+    if (parallel) {
+        req->njobs = MIN(s->offload_jobs, req->blocks * AVRK_BLOCK_SIZE /
+                                          AVRK_OFFLOAD_SLICE_MIN);
+        req->njobs = MAX(req->njobs, 1);
+    }
+    slice = DIV_ROUND_UP(req->blocks, req->njobs);
+    if (parallel && c->mode == AVRK_MODE_XTS) {
+        slice = QEMU_ALIGN_UP(slice, c->xts_unit_blocks);
+    }
+    req->njobs = DIV_ROUND_UP(req->blocks, slice);
+
+    for (i = 0; i < req->njobs; i++) {
+        AvrkCryptJob *job = &req->jobs[i];
+
+        start = i * slice;
+        job->req = req;
+        job->buf = req->buf + start * AVRK_BLOCK_SIZE;
+        job->blocks = MIN(slice, req->blocks - start);
+        job->chain = *c;
+        if (!start) {
+            continue;
+        }
+        switch (c->mode) {
+        case AVRK_MODE_CBC:
+            /* copied now, the previous slice overwrites it in place */
+            memcpy(job->chain.iv, job->buf - AVRK_BLOCK_SIZE,
+                   AVRK_BLOCK_SIZE);
+            break;
+        case AVRK_MODE_CTR:
+            avrk_be_add(job->chain.iv, start);
+            break;
+        case AVRK_MODE_XTS:
+            avrk_le_add(job->chain.iv, start / c->xts_unit_blocks);
+            break;
+        }
+    }
+}
+
+/*
+ * Hand the whole blocks of a large OUT packet to the thread pool and
+ * complete the packet asynchronously.  Returns false if the packet should
+ * rather be processed synchronously.
+ */
+static bool usb_avrk_crypt_submit(USBAvrkState *s, USBPacket *p, uint32_t len)
+{
+    ThreadPool *pool = aio_get_thread_pool(qemu_get_aio_context());
+    AvrkCryptRequest *req;
+    uint32_t head = 0;
+    uint8_t *out;
+    int i;
+
+    if (!s->offload_threshold ||
+        len < MAX(s->offload_threshold, 2 * AVRK_BLOCK_SIZE)) {
+        return false;
+    }
+
+    /* complete a carried-over partial block here, it is just one */
+    if (s->stream_fill) {
+        head = AVRK_BLOCK_SIZE - s->stream_fill;
+        usb_packet_copy(p, s->stream_block + s->stream_fill, head);
+        out = usb_avrk_stream_reserve(s, AVRK_BLOCK_SIZE);
+        usb_avrk_stream_blocks(s, s->stream_block, out, 1);
+        s->stream_used += AVRK_BLOCK_SIZE;
+        s->stream_fill = 0;
+    }
+
+    req = g_new0(AvrkCryptRequest, 1);
+    req->s = s;
+    req->p = p;
+    req->aes = s->aes[s->stream_slot];
+    req->tweak_aes = s->tweak_aes;
+    req->blocks = (len - head) / AVRK_BLOCK_SIZE;
+    req->buf = g_malloc(req->blocks * AVRK_BLOCK_SIZE);
+    usb_packet_copy(p, req->buf, req->blocks * AVRK_BLOCK_SIZE);
+
+    s->stream_fill = len - head - req->blocks * AVRK_BLOCK_SIZE;
+    usb_packet_copy(p, s->stream_block, s->stream_fill);
+
+    usb_avrk_crypt_split(s, req);
+    req->pending = req->njobs;
+    s->crypt_req = req;
+    for (i = 0; i < req->njobs; i++) {
+        thread_pool_submit_aio(pool, usb_avrk_crypt_worker, &req->jobs[i],
+                               usb_avrk_crypt_complete, &req->jobs[i]);
+    }
+
+    p->status = USB_RET_ASYNC;
+    return true;
+}
+
+/*
+ * Wait for an offloaded packet, so that the stream state is current.  Only
+ * for migration and unplug, guest requests get a STALL or NAK instead.
+ */
+static void usb_avrk_crypt_drain(USBAvrkState *s)
+{
+    while (s->crypt_req) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+}
+
+static void usb_avrk_cancel_packet(USBDevice *dev, USBPacket *p)
+{
+    USBAvrkState *s = (USBAvrkState *)dev;
+
+    /* the workers cannot be stopped, the packet just isn't completed */
+    if (s->crypt_req && s->crypt_req->p == p) {
+        s->crypt_req->p = NULL;
+    }
+}
+
+static void usb_avrk_handle_data(USBDevice *dev, USBPacket *p)
+{
+    USBAvrkState *s = (USBAvrkState *)dev;
+    uint32_t len = usb_packet_size(p);
+
+    switch (p->pid) {
+    case USB_TOKEN_OUT:
+        if (p->ep->nr != AVRK_EP_STREAM_OUT ||
+            len > AVRK_STREAM_PACKET_MAX) {
+            goto fail;
+        }
+        /* a cancelled packet may still be in flight */
+        if (s->crypt_req ||
+            (s->stream_used &&
+             s->stream_used + s->stream_fill + len > AVRK_STREAM_BUF_MAX)) {
+            p->status = USB_RET_NAK;
+            break;
+        }
+        if (usb_avrk_crypt_submit(s, p, len)) {
+            break;
+        }
+        if (len > s->stream_scratch_size) {
+            s->stream_scratch = g_realloc(s->stream_scratch, len);
+            s->stream_scratch_size = len;
+        }
+        usb_packet_copy(p, s->stream_scratch, len);
+        usb_avrk_stream_process(s, s->stream_scratch, len);
+        break;
+
+    case USB_TOKEN_IN:
+        if (p->ep->nr != AVRK_EP_STREAM_IN) {
+            goto fail;
+        }
+        len = MIN(len, s->stream_used);
+        if (!len) {
+            p->status = USB_RET_NAK;
+            break;
+        }
+        usb_packet_copy(p, s->stream_buf + s->stream_start, len);
+        s->stream_start += len;
+        s->stream_used -= len;
+        if (!s->stream_used) {
+            s->stream_start = 0;
+        }
+        break;
+
+    default:
+        DPRINTF("Bad token\n");
+    fail:
+        p->status = USB_RET_STALL;
+        break;
+    }
+}
+
+static void usb_avrk_state_write(USBAvrkState *s, size_t offset, size_t len)
+{
+    if (pwrite(s->fd, (uint8_t *)s->state + offset, len, offset) != (ssize_t)len) {
+        error_report("usb-avrk: writing %s: %s", s->filename,
+                     strerror(errno));
+    }
+}
+
+static void usb_avrk_state_flush(USBAvrkState *s)
+{
+    if (s->persist_dirty) {
+        usb_avrk_state_write(s, 0, sizeof(*s->state));
+        s->persist_dirty = false;
+    }
+}
+
+static void usb_avrk_persist_timer(void *opaque)
+{
+    usb_avrk_state_flush(opaque);
+}
+
+/* AvrkDeviceState bytes [@offset, @offset + @len) have been modified */
+static void usb_avrk_state_changed(USBAvrkState *s, size_t offset, size_t len)
+{
+    switch (s->persist_mode) {
+    case AVRK_PERSIST_WRITETHROUGH:
+        if (offset == offsetof(AvrkDeviceState, key) ||
+            offset == offsetof(AvrkDeviceState, flash)) {
+            usb_avrk_state_write(s, offset, len);
+            qemu_fdatasync(s->fd);
+        }
+        break;
+    case AVRK_PERSIST_PERIODIC:
+        if (!s->persist_dirty) {
+            s->persist_dirty = true;
+            qemu_mod_timer(s->persist_timer, qemu_get_clock_ms(rt_clock) +
+                                             s->persist_interval);
+        }
+        break;
+    }
+}
+
+#define usb_avrk_persist(s, field) \
+    usb_avrk_state_changed(s, offsetof(AvrkDeviceState, field), \
+                           sizeof(((AvrkDeviceState *)0)->field))
+
+static uint8_t *usb_avrk_key(USBAvrkState *s, int slot)
+{
+    return slot ? s->slot_keys[slot] : s->state->key;
+}
+
+static void usb_avrk_set_key(USBAvrkState *s, int slot, const uint8_t *key)
+{
+    memcpy(usb_avrk_key(s, slot), key, AVRK_BLOCK_SIZE);
+    AES128_init_ctx(&s->aes[slot], usb_avrk_key(s, slot));
+    if (!slot) {
+        usb_avrk_persist(s, key);
+    }
+}
+
 static void usb_avrk_handle_control(USBDevice *dev, USBPacket *p,
                int request, int value, int index, int length, uint8_t *data)
 {
     USBAvrkState *s = (USBAvrkState*)dev;
-    int ret;
+    int ret, i, n;
 
     DPRINTF("got control %x, value %x\n",request, value);
     ret = usb_desc_handle_control(dev, p, request, value, index, length, data);
     if (ret >= 0)
         return;
 
+    switch (request & 0xff) {
+    case REQ_STREAM_RESET:
+    case REQ_STREAM_FLUSH:
+    case REQ_SET_MODE:
+    case REQ_SET_IV:
+    case REQ_CHANGE_TWEAK_KEY:
+        /* the stream state is only current once the offload is done */
+        if (s->crypt_req) {
+            p->status = USB_RET_STALL;
+            return;
+        }
+        break;
+    }
+
     switch (request) {
         case REQ_LED_ON | VendorOutRequest:
             s->state->led = 1;
+            usb_avrk_persist(s, led);
             break;
         case REQ_LED_OFF | VendorOutRequest:
             s->state->led = 0;
+            usb_avrk_persist(s, led);
             break;
         case REQ_LED_CTL | VendorOutRequest:
             if (value)
                 s->state->flash = 1;
             else
                 s->state->flash = 0;
+            usb_avrk_persist(s, flash);
             break;
+        /* wLength may cover several consecutive slots starting at wIndex */
         case REQ_CHANGE_KEY | VendorOutRequest:
-            memcpy(s->state->key, data, 16);
+            n = MAX(length / AVRK_BLOCK_SIZE, 1);
+            if (index + n > AVRK_KEYSLOTS) {
+                p->status = USB_RET_STALL;
+                break;
+            }
+            for (i = 0; i < n; i++) {
+                usb_avrk_set_key(s, index + i, data + i * AVRK_BLOCK_SIZE);
+            }
             break;
         case REQ_CHANGE_KEY | VendorInRequest:
-            memcpy(data, s->state->key, 16);
-            p->actual_length = 16;
+            n = MAX(length / AVRK_BLOCK_SIZE, 1);
+            if (index + n > AVRK_KEYSLOTS) {
+                p->status = USB_RET_STALL;
+                break;
+            }
+            for (i = 0; i < n; i++) {
+                memcpy(data + i * AVRK_BLOCK_SIZE, usb_avrk_key(s, index + i),
+                       AVRK_BLOCK_SIZE);
+            }
+            p->actual_length = n * AVRK_BLOCK_SIZE;
             break;
         case REQ_UPLOAD_A | VendorOutRequest:
         case REQ_UPLOAD_B | VendorOutRequest:
@@ -152,10 +849,64 @@ static void usb_avrk_handle_control(USBDevice *dev, USBPacket *p,
                 request -= REQ_UPLOAD_A;
                 memcpy(s->state->buf + 4 * request, &value, 2);
                 memcpy(s->state->buf + 4 * request + 2, &index, 2);
+                usb_avrk_persist(s, buf);
                 break;
             }
         case REQ_START_ENCRYPT | VendorOutRequest:
-            AES128_ECB_encrypt(s->state->buf, s->state->key, s->state->outbuf);
+            if (index >= AVRK_KEYSLOTS) {
+                p->status = USB_RET_STALL;
+                break;
+            }
+            AES128_ECB_encrypt_ctx(&s->aes[index], s->state->buf,
+                                   s->state->outbuf);
+            usb_avrk_persist(s, outbuf);
+            break;
+        case REQ_START_DECRYPT | VendorOutRequest:
+            if (index >= AVRK_KEYSLOTS) {
+                p->status = USB_RET_STALL;
+                break;
+            }
+            AES128_ECB_decrypt_ctx(&s->aes[index], s->state->buf,
+                                   s->state->outbuf);
+            usb_avrk_persist(s, outbuf);
+            break;
+        case REQ_SET_MODE | VendorOutRequest:
+            if ((value & 0xff) >= AVRK_MODE_MAX) {
+                p->status = USB_RET_STALL;
+                break;
+            }
+            s->chain.mode = value & 0xff;
+            s->chain.decrypt = !!(value & AVRK_MODE_DECRYPT);
+            s->chain.xts_unit_blocks = index;
+            s->chain.xts_unit_left = 0;
+            s->stream_fill = 0;
+            break;
+        case REQ_SET_MODE | VendorInRequest:
+            data[0] = s->chain.mode;
+            data[1] = s->chain.decrypt;
+            p->actual_length = 2;
+            break;
+        case REQ_SET_IV | VendorOutRequest:
+            if (length < AVRK_BLOCK_SIZE) {
+                p->status = USB_RET_STALL;
+                break;
+            }
+            memcpy(s->chain.iv, data, AVRK_BLOCK_SIZE);
+            s->chain.xts_unit_left = 0;
+            s->stream_fill = 0;
+            break;
+        case REQ_SET_IV | VendorInRequest:
+            memcpy(data, s->chain.iv, AVRK_BLOCK_SIZE);
+            p->actual_length = AVRK_BLOCK_SIZE;
+            break;
+        case REQ_CHANGE_TWEAK_KEY | VendorOutRequest:
+            if (length < AVRK_BLOCK_SIZE) {
+                p->status = USB_RET_STALL;
+                break;
+            }
+            memcpy(s->tweak_key, data, AVRK_BLOCK_SIZE);
+            AES128_init_ctx(&s->tweak_aes, s->tweak_key);
+            s->chain.xts_unit_left = 0;
             break;
         case REQ_DOWNLOAD_A | VendorInRequest:
         case REQ_DOWNLOAD_B | VendorInRequest:
@@ -166,6 +917,17 @@ static void usb_avrk_handle_control(USBDevice *dev, USBPacket *p,
                 p->actual_length = 8;
                 break;
             }
+        case REQ_STREAM_RESET | VendorOutRequest:
+            if (index >= AVRK_KEYSLOTS) {
+                p->status = USB_RET_STALL;
+                break;
+            }
+            usb_avrk_stream_reset(s);
+            s->stream_slot = index;
+            break;
+        case REQ_STREAM_FLUSH | VendorOutRequest:
+            usb_avrk_stream_flush(s);
+            break;
         case REQ_STATUS | VendorInRequest:
             {
                 data[0] = 0;
@@ -179,21 +941,158 @@ static void usb_avrk_handle_control(USBDevice *dev, USBPacket *p,
 
 }
 
+/* AvrkDeviceState lives behind a pointer, possibly into the state file */
+static void usb_avrk_put_state(QEMUFile *f, void *pv, size_t size)
+{
+    USBAvrkState *s = pv;
+
+    qemu_put_buffer(f, (uint8_t *)s->state, sizeof(*s->state));
+}
+
+static int usb_avrk_get_state(QEMUFile *f, void *pv, size_t size)
+{
+    USBAvrkState *s = pv;
+
+    qemu_get_buffer(f, (uint8_t *)s->state, sizeof(*s->state));
+    return 0;
+}
+
+static const VMStateInfo usb_avrk_state_vmstate_info = {
+    .name = "usb-avrk-state",
+    .put  = usb_avrk_put_state,
+    .get  = usb_avrk_get_state,
+};
+
+/* only the queued part of the stream buffer is sent */
+static void usb_avrk_put_stream(QEMUFile *f, void *pv, size_t size)
+{
+    USBAvrkState *s = pv;
+
+    qemu_put_be32(f, s->stream_used);
+    qemu_put_buffer(f, s->stream_buf + s->stream_start, s->stream_used);
+}
+
+static int usb_avrk_get_stream(QEMUFile *f, void *pv, size_t size)
+{
+    USBAvrkState *s = pv;
+    uint32_t len = qemu_get_be32(f);
+
+    if (len > AVRK_STREAM_BUF_MAX + AVRK_STREAM_PACKET_MAX) {
+        return -EINVAL;
+    }
+    s->stream_start = 0;
+    s->stream_used = 0;
+    qemu_get_buffer(f, usb_avrk_stream_reserve(s, len), len);
+    s->stream_used = len;
+    return 0;
+}
+
+static const VMStateInfo usb_avrk_stream_vmstate_info = {
+    .name = "usb-avrk-stream",
+    .put  = usb_avrk_put_stream,
+    .get  = usb_avrk_get_stream,
+};
+
+static void usb_avrk_pre_save(void *opaque)
+{
+    USBAvrkState *s = opaque;
+
+    /* make the stream and the source's copy of the state file current */
+    usb_avrk_crypt_drain(s);
+    if (s->persist_mode == AVRK_PERSIST_SHARED) {
+        msync(s->state, sizeof(*s->state), MS_SYNC);
+    }
+    usb_avrk_state_flush(s);
+}
+
+static int usb_avrk_post_load(void *opaque, int version_id)
+{
+    USBAvrkState *s = opaque;
+
+    int i;
+
+    if (s->chain.mode >= AVRK_MODE_MAX ||
+        s->stream_fill >= AVRK_BLOCK_SIZE ||
+        s->stream_slot >= AVRK_KEYSLOTS) {
+        return -EINVAL;
+    }
+    for (i = 0; i < AVRK_KEYSLOTS; i++) {
+        AES128_init_ctx(&s->aes[i], usb_avrk_key(s, i));
+    }
+    AES128_init_ctx(&s->tweak_aes, s->tweak_key);
+
+    /*
+     * The migrated state supersedes the destination's state file.  A shared
+     * mapping has already been updated in place; a write-back file gets the
+     * whole state, so that it hands over correctly even when both sides
+     * use different files.
+     */
+    if (s->fd != -1) {
+        s->persist_dirty = true;
+        usb_avrk_state_flush(s);
+        qemu_fdatasync(s->fd);
+    }
+    return 0;
+}
+
 static const VMStateDescription vmstate_usb_avrk = {
     .name = "usb-avrk",
-    .unmigratable = 1,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = usb_avrk_pre_save,
+    .post_load = usb_avrk_post_load,
+    .fields = (VMStateField []) {
+        VMSTATE_USB_DEVICE(dev, USBAvrkState),
+        {
+            .name         = "state",
+            .info         = &usb_avrk_state_vmstate_info,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        VMSTATE_UINT8(chain.mode, USBAvrkState),
+        VMSTATE_BOOL(chain.decrypt, USBAvrkState),
+        VMSTATE_UINT8_ARRAY(chain.iv, USBAvrkState, AVRK_BLOCK_SIZE),
+        VMSTATE_UINT8_ARRAY(chain.xts_tweak, USBAvrkState, AVRK_BLOCK_SIZE),
+        VMSTATE_UINT32(chain.xts_unit_blocks, USBAvrkState),
+        VMSTATE_UINT32(chain.xts_unit_left, USBAvrkState),
+        VMSTATE_UINT8_ARRAY(tweak_key, USBAvrkState, AVRK_BLOCK_SIZE),
+        VMSTATE_UINT8_ARRAY(stream_block, USBAvrkState, AVRK_BLOCK_SIZE),
+        VMSTATE_UINT32(stream_fill, USBAvrkState),
+        {
+            .name         = "stream",
+            .info         = &usb_avrk_stream_vmstate_info,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        VMSTATE_BUFFER_UNSAFE(slot_keys, USBAvrkState, 0,
+                              AVRK_KEYSLOTS * AVRK_BLOCK_SIZE),
+        VMSTATE_UINT8(stream_slot, USBAvrkState),
+        VMSTATE_END_OF_LIST()
+    }
 };
 
 static Property avrk_properties[] = {
     DEFINE_PROP_STRING("filename", USBAvrkState, filename),
+    DEFINE_PROP_STRING("persist", USBAvrkState, persist),
+    DEFINE_PROP_UINT32("persist-interval", USBAvrkState, persist_interval,
+                       AVRK_PERSIST_INTERVAL),
+    DEFINE_PROP_UINT32("offload-threshold", USBAvrkState, offload_threshold,
+                       AVRK_OFFLOAD_THRESHOLD),
+    DEFINE_PROP_UINT32("offload-jobs", USBAvrkState, offload_jobs, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
 static void usb_avrk_handle_reset(USBDevice *dev)
 {
-    /*USBAvrkState *s = (USBAvrkState *)dev;*/
+    USBAvrkState *s = (USBAvrkState *)dev;
 
     DPRINTF("Reset\n");
+    if (s->crypt_req) {
+        s->crypt_req->discard = true;
+    }
+    usb_avrk_stream_reset(s);
+    s->stream_slot = 0;
+    memset(&s->chain, 0, sizeof(s->chain));
 }
 
 static int usb_avrk_initfn(USBDevice *dev)
@@ -208,9 +1107,27 @@ static int usb_avrk_initfn(USBDevice *dev)
     USBAvrkState *s = DO_UPCAST(USBAvrkState, dev, dev);
     struct stat stat;
     int flash_device = 0;
+    int i;
+    int flags = O_RDWR | O_CREAT;
     if (!s->filename)
         s->filename = default_filename;
 
+    s->persist_mode = AVRK_PERSIST_SHARED;
+    if (s->persist) {
+        for (s->persist_mode = 0;
+             s->persist_mode < ARRAY_SIZE(avrk_persist_names);
+             s->persist_mode++) {
+            if (!strcmp(s->persist, avrk_persist_names[s->persist_mode]))
+                break;
+        }
+        if (s->persist_mode == ARRAY_SIZE(avrk_persist_names)) {
+            error_report("usb-avrk: unknown persist mode '%s'", s->persist);
+            return -1;
+        }
+    }
+    if (s->persist_mode == AVRK_PERSIST_VOLATILE)
+        flags = O_RDONLY;
+
     char *filename;
     if (s->filename[0] == '/')
         filename = s->filename;
@@ -224,34 +1141,71 @@ static int usb_avrk_initfn(USBDevice *dev)
         memcpy(filename + current_dir_length + 1, s->filename, filename_length + 1);
     }
 
-    int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    int fd = open(filename, flags, 0644);
     if (filename != s->filename)
         free(filename);
     if (fd == -1) {
-        ERROR_REPORT("open");
-    }
+        /* a volatile stick without a state file starts out unflashed */
+        if (flags != O_RDONLY || errno != ENOENT)
+            ERROR_REPORT("open");
+        flash_device = 1;
+    } else {
+        if (fstat(fd, &stat))
+            ERROR_OUT("fstat");
 
-    if (fstat(fd, &stat))
-        ERROR_REPORT("fstat");
-
-    if (stat.st_size != sizeof(*s->state)) {
-        if (ftruncate(fd, sizeof(*s->state)))
-            ERROR_OUT("ftruncate");
-        else
-            flash_device = 1;
+        if (stat.st_size != sizeof(*s->state)) {
+            if (flags == O_RDONLY)
+                flash_device = 1;
+            else if (ftruncate(fd, sizeof(*s->state)))
+                ERROR_OUT("ftruncate");
+            else
+                flash_device = 1;
+        }
     }
 
-    s->state = mmap(NULL, sizeof(*s->state),
-            PROT_WRITE|PROT_READ, MAP_SHARED, fd, 0);
-    if (s->state == MAP_FAILED)
-        ERROR_OUT("mmap");
+    if (s->persist_mode == AVRK_PERSIST_SHARED) {
+        s->state = mmap(NULL, sizeof(*s->state),
+                PROT_WRITE|PROT_READ, MAP_SHARED, fd, 0);
+        if (s->state == MAP_FAILED)
+            ERROR_OUT("mmap");
+        close(fd);
+        fd = -1;
+    } else {
+        s->state = g_new0(AvrkDeviceState, 1);
+        if (!flash_device &&
+            pread(fd, s->state, sizeof(*s->state), 0) != sizeof(*s->state)) {
+            g_free(s->state);
+            ERROR_OUT("read");
+        }
+        if (s->persist_mode == AVRK_PERSIST_VOLATILE && fd != -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    s->fd = fd;
+    if (s->persist_mode == AVRK_PERSIST_PERIODIC) {
+        s->persist_timer = qemu_new_timer_ms(rt_clock, usb_avrk_persist_timer,
+                                             s);
+    }
 
-    close(fd);
     if (flash_device) {
         memset(s->state, 0, sizeof(*s->state));
         memcpy(s->state->key, "OperatingSystems", 16);
         s->state->flash = 1;
+        if (s->fd != -1 && s->persist_mode != AVRK_PERSIST_SHARED) {
+            usb_avrk_state_write(s, 0, sizeof(*s->state));
+        }
+    }
+    /* slots other than 0 hold an all-zero key until set */
+    for (i = 0; i < AVRK_KEYSLOTS; i++) {
+        AES128_init_ctx(&s->aes[i], usb_avrk_key(s, i));
+    }
+    /* all-zero until the guest sets one with REQ_CHANGE_TWEAK_KEY */
+    AES128_init_ctx(&s->tweak_aes, s->tweak_key);
+    if (!s->offload_jobs) {
+        s->offload_jobs = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
     }
+    s->offload_jobs = MIN(s->offload_jobs, AVRK_OFFLOAD_JOBS_MAX);
 
     usb_desc_create_serial(dev);
     usb_desc_init(dev);
@@ -269,7 +1223,23 @@ static int usb_avrk_initfn(USBDevice *dev)
 static void usb_avrk_handle_destroy(USBDevice *dev)
 {
     USBAvrkState *s = (USBAvrkState*)dev;
-    munmap(s->state, sizeof(*s->state));
+
+    usb_avrk_crypt_drain(s);
+    if (s->persist_timer) {
+        qemu_del_timer(s->persist_timer);
+        qemu_free_timer(s->persist_timer);
+        usb_avrk_state_flush(s);
+    }
+    if (s->fd != -1) {
+        close(s->fd);
+    }
+    if (s->persist_mode == AVRK_PERSIST_SHARED) {
+        munmap(s->state, sizeof(*s->state));
+    } else {
+        g_free(s->state);
+    }
+    g_free(s->stream_buf);
+    g_free(s->stream_scratch);
 }
 
 static void usb_avrk_class_initfn(ObjectClass *klass, void *data)
@@ -282,6 +1252,8 @@ static void usb_avrk_class_initfn(ObjectClass *klass, void *data)
     uc->usb_desc       = &desc_avrk;
     uc->handle_reset   = usb_avrk_handle_reset;
     uc->handle_control = usb_avrk_handle_control;
+    uc->handle_data    = usb_avrk_handle_data;
+    uc->cancel_packet  = usb_avrk_cancel_packet;
     uc->handle_destroy = usb_avrk_handle_destroy;
     dc->vmsd = &vmstate_usb_avrk;
     dc->props = avrk_properties;
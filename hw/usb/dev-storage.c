@@ -17,6 +17,7 @@
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/blockdev.h"
+#include "sysemu/dma.h"
 
 //#define DEBUG_MSD
 
@@ -54,6 +55,14 @@ typedef struct {
     struct usb_msd_csw csw;
     SCSIRequest *req;
     SCSIBus bus;
+    /* Command waiting for its data packet, see usb_msd_send_command.  */
+    bool cbw_pending;
+    uint32_t cbw_tag;
+    uint8_t cbw_lun;
+    uint8_t cbw_cmd[16];
+    /* Zero copy transfer between the data packet and the SCSI device.  */
+    QEMUSGList sg;
+    bool sg_active;
     /* For async completion.  */
     USBPacket *packet;
     /* usb-storage only */
@@ -249,7 +258,10 @@ static void usb_msd_packet_complete(MSDState *s)
        usb_packet_complete returns.  */
     DPRINTF("Packet complete %p\n", p);
     s->packet = NULL;
-    usb_packet_complete(&s->dev, p);
+    /* Zero copy commands may finish before handle_data has returned */
+    if (p->state == USB_PACKET_ASYNC) {
+        usb_packet_complete(&s->dev, p);
+    }
 }
 
 static void usb_msd_transfer_data(SCSIRequest *req, uint32_t len)
@@ -274,15 +286,41 @@ static void usb_msd_command_complete(SCSIRequest *req, uint32_t status, size_t r
 {
     MSDState *s = DO_UPCAST(MSDState, dev.qdev, req->bus->qbus.parent);
     USBPacket *p = s->packet;
+    bool zero_copy = s->sg_active;
+    uint32_t len = 0;
 
     DPRINTF("Command complete %d tag 0x%x\n", status, req->tag);
 
+    if (zero_copy) {
+        /* The data went straight between the packet and the disk.  */
+        len = status ? 0 : s->sg.size - MIN(resid, s->sg.size);
+        qemu_sglist_destroy(&s->sg);
+        s->sg_active = false;
+        s->data_len -= len;
+    }
+
     s->csw.sig = cpu_to_le32(0x53425355);
     s->csw.tag = cpu_to_le32(req->tag);
     s->csw.residue = cpu_to_le32(s->data_len);
     s->csw.status = status != 0;
 
-    if (s->packet) {
+    /* Done with the request before completing packets, a pipelined
+       status packet may be handed to us right away.  */
+    scsi_req_unref(req);
+    s->req = NULL;
+
+    if (s->packet && zero_copy) {
+        /* Zero copy data packet, account for it and pad as below.  */
+        usb_packet_skip(p, len);
+        len = MIN(p->iov.size - p->actual_length, s->data_len);
+        usb_packet_skip(p, len);
+        s->data_len -= len;
+        if (s->data_len == 0) {
+            s->mode = USB_MSDM_CSW;
+        }
+        p->status = USB_RET_SUCCESS; /* Clear previous ASYNC status */
+        usb_msd_packet_complete(s);
+    } else if (s->packet) {
         if (s->data_len == 0 && s->mode == USB_MSDM_DATAOUT) {
             /* A deferred packet with no write data remaining must be
                the status read packet.  */
@@ -306,8 +344,6 @@ static void usb_msd_command_complete(SCSIRequest *req, uint32_t status, size_t r
     } else if (s->data_len == 0) {
         s->mode = USB_MSDM_CSW;
     }
-    scsi_req_unref(req);
-    s->req = NULL;
 }
 
 static void usb_msd_request_cancelled(SCSIRequest *req)
@@ -318,7 +354,58 @@ static void usb_msd_request_cancelled(SCSIRequest *req)
         scsi_req_unref(s->req);
         s->req = NULL;
         s->scsi_len = 0;
+        if (s->sg_active) {
+            qemu_sglist_destroy(&s->sg);
+            s->sg_active = false;
+        }
+    }
+}
+
+static QEMUSGList *usb_msd_get_sg_list(SCSIRequest *req)
+{
+    MSDState *s = DO_UPCAST(MSDState, dev.qdev, req->bus->qbus.parent);
+
+    return s->sg_active ? &s->sg : NULL;
+}
+
+/*
+ * If the host controller maps packets straight onto guest RAM, commands
+ * with a data phase are only passed on to the SCSI device once the first
+ * data packet shows up.  If that packet covers the whole data phase, the
+ * SCSI device gets it as scatter/gather list and transfers to / from it
+ * directly, instead of going through its bounce buffer and
+ * usb_msd_copy_data.  Returns true if the packet was taken for that.
+ */
+static bool usb_msd_send_command(MSDState *s, USBPacket *p)
+{
+    SCSIDevice *scsi_dev;
+    uint32_t len;
+    bool zero_copy = false;
+
+    s->cbw_pending = false;
+    scsi_dev = scsi_device_find(&s->bus, 0, 0, s->cbw_lun);
+    assert(scsi_dev != NULL);
+    s->req = scsi_req_new(scsi_dev, s->cbw_tag, s->cbw_lun, s->cbw_cmd, NULL);
+#ifdef DEBUG_MSD
+    scsi_req_print(s->req);
+#endif
+    if (p && s->req->cmd.xfer == s->data_len &&
+        (s->req->cmd.mode == SCSI_XFER_FROM_DEV) == (p->pid == USB_TOKEN_IN) &&
+        usb_packet_map_sglist(p, &s->sg, p->actual_length,
+                              s->data_len) == 0) {
+        s->sg_active = true;
+        s->packet = p;
+        zero_copy = true;
     }
+    len = scsi_req_enqueue(s->req);
+    if (len) {
+        scsi_req_continue(s->req);
+    }
+    if (zero_copy && s->packet == p) {
+        DPRINTF("Deferring packet %p [zero copy]\n", p);
+        p->status = USB_RET_ASYNC;
+    }
+    return zero_copy;
 }
 
 static void usb_msd_handle_reset(USBDevice *dev)
@@ -330,6 +417,7 @@ static void usb_msd_handle_reset(USBDevice *dev)
         scsi_req_cancel(s->req);
     }
     assert(s->req == NULL);
+    s->cbw_pending = false;
 
     if (s->packet) {
         s->packet->status = USB_RET_STALL;
@@ -348,6 +436,16 @@ static void usb_msd_handle_control(USBDevice *dev, USBPacket *p,
 
     ret = usb_desc_handle_control(dev, p, request, value, index, length, data);
     if (ret >= 0) {
+        if (request == (DeviceOutRequest | USB_REQ_SET_CONFIGURATION) ||
+            request == (InterfaceOutRequest | USB_REQ_SET_INTERFACE)) {
+            /*
+             * Let the host controller hand us all packets of a data phase
+             * up front, so the next one is served as soon as the previous
+             * one completes.  usb_desc resets this on (re)configuration.
+             */
+            usb_ep_set_pipeline(dev, USB_TOKEN_IN, 1, true);
+            usb_ep_set_pipeline(dev, USB_TOKEN_OUT, 2, true);
+        }
         return;
     }
 
@@ -358,6 +456,7 @@ static void usb_msd_handle_control(USBDevice *dev, USBPacket *p,
     case ClassInterfaceOutRequest | MassStorageReset:
         /* Reset state ready for the next CBW.  */
         s->mode = USB_MSDM_CBW;
+        s->cbw_pending = false;
         break;
     case ClassInterfaceRequest | GetMaxLun:
         maxlun = 0;
@@ -400,7 +499,16 @@ static void usb_msd_handle_data(USBDevice *dev, USBPacket *p)
     struct usb_msd_cbw cbw;
     uint8_t devep = p->ep->nr;
     SCSIDevice *scsi_dev;
-    uint32_t len;
+
+    if (p->state == USB_PACKET_SETUP && !QTAILQ_EMPTY(&p->ep->queue)) {
+        /*
+         * Pipelined packet behind one we are still working on.  Have the
+         * usb core queue it, it gets handed back to us in order as soon
+         * as the ones in front of it complete.
+         */
+        p->status = USB_RET_ADD_TO_QUEUE;
+        return;
+    }
 
     switch (p->pid) {
     case USB_TOKEN_OUT:
@@ -438,13 +546,13 @@ static void usb_msd_handle_data(USBDevice *dev, USBPacket *p)
                     tag, cbw.flags, cbw.cmd_len, s->data_len);
             assert(le32_to_cpu(s->csw.residue) == 0);
             s->scsi_len = 0;
-            s->req = scsi_req_new(scsi_dev, tag, cbw.lun, cbw.cmd, NULL);
-#ifdef DEBUG_MSD
-            scsi_req_print(s->req);
-#endif
-            len = scsi_req_enqueue(s->req);
-            if (len) {
-                scsi_req_continue(s->req);
+            s->cbw_tag = tag;
+            s->cbw_lun = cbw.lun;
+            memcpy(s->cbw_cmd, cbw.cmd, sizeof(s->cbw_cmd));
+            s->cbw_pending = true;
+            /* The data packets come from the same host controller */
+            if (s->data_len == 0 || p->sgl == NULL) {
+                usb_msd_send_command(s, NULL);
             }
             break;
 
@@ -454,6 +562,9 @@ static void usb_msd_handle_data(USBDevice *dev, USBPacket *p)
                 goto fail;
             }
 
+            if (s->cbw_pending && usb_msd_send_command(s, p)) {
+                break;
+            }
             if (s->scsi_len) {
                 usb_msd_copy_data(s, p);
             }
@@ -513,6 +624,9 @@ static void usb_msd_handle_data(USBDevice *dev, USBPacket *p)
         case USB_MSDM_DATAIN:
             DPRINTF("Data in %zd/%d, scsi_len %d\n",
                     p->iov.size, s->data_len, s->scsi_len);
+            if (s->cbw_pending && usb_msd_send_command(s, p)) {
+                break;
+            }
             if (s->scsi_len) {
                 usb_msd_copy_data(s, p);
             }
@@ -577,6 +691,7 @@ static const struct SCSIBusInfo usb_msd_scsi_info_storage = {
     .transfer_data = usb_msd_transfer_data,
     .complete = usb_msd_command_complete,
     .cancel = usb_msd_request_cancelled,
+    .get_sg_list = usb_msd_get_sg_list,
     .load_request = usb_msd_load_request,
 };
 
@@ -588,6 +703,7 @@ static const struct SCSIBusInfo usb_msd_scsi_info_bot = {
     .transfer_data = usb_msd_transfer_data,
     .complete = usb_msd_command_complete,
     .cancel = usb_msd_request_cancelled,
+    .get_sg_list = usb_msd_get_sg_list,
     .load_request = usb_msd_load_request,
 };
 
@@ -714,6 +830,26 @@ static USBDevice *usb_msd_init(USBBus *bus, const char *filename)
     return dev;
 }
 
+static bool usb_msd_cbw_needed(void *opaque)
+{
+    MSDState *s = opaque;
+
+    return s->cbw_pending;
+}
+
+static const VMStateDescription vmstate_usb_msd_cbw = {
+    .name = "usb-storage/cbw",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField []) {
+        VMSTATE_BOOL(cbw_pending, MSDState),
+        VMSTATE_UINT32(cbw_tag, MSDState),
+        VMSTATE_UINT8(cbw_lun, MSDState),
+        VMSTATE_BUFFER(cbw_cmd, MSDState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_usb_msd = {
     .name = "usb-storage",
     .version_id = 1,
@@ -729,6 +865,14 @@ static const VMStateDescription vmstate_usb_msd = {
         VMSTATE_UINT32(csw.residue, MSDState),
         VMSTATE_UINT8(csw.status, MSDState),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection []) {
+        {
+            .vmsd = &vmstate_usb_msd_cbw,
+            .needed = usb_msd_cbw_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -18,6 +18,7 @@
 #include "hw/usb/desc.h"
 #include "hw/scsi/scsi.h"
 #include "block/scsi.h"
+#include "sysemu/dma.h"
 
 /* --------------------------------------------------------------------- */
 
@@ -137,6 +138,8 @@ struct UASRequest {
     uint32_t     buf_size;
     uint32_t     data_off;
     uint32_t     data_size;
+    QEMUSGList   sg;
+    bool         sg_active;
     QTAILQ_ENTRY(UASRequest)  next;
 };
 
@@ -569,6 +572,14 @@ static void usb_uas_scsi_transfer_data(SCSIRequest *r, uint32_t len)
     }
 }
 
+static void usb_uas_release_sg(UASRequest *req)
+{
+    if (req->sg_active) {
+        qemu_sglist_destroy(&req->sg);
+        req->sg_active = false;
+    }
+}
+
 static void usb_uas_scsi_command_complete(SCSIRequest *r,
                                           uint32_t status, size_t resid)
 {
@@ -576,6 +587,12 @@ static void usb_uas_scsi_command_complete(SCSIRequest *r,
 
     trace_usb_uas_scsi_complete(req->uas->dev.addr, req->tag, status, resid);
     req->complete = true;
+    if (req->sg_active && req->data) {
+        /* zero copy, the data already is where it belongs */
+        usb_packet_skip(req->data, status != GOOD ? 0 :
+                        req->sg.size - MIN(resid, req->sg.size));
+    }
+    usb_uas_release_sg(req);
     if (req->data) {
         usb_uas_complete_data_packet(req);
     }
@@ -588,9 +605,17 @@ static void usb_uas_scsi_request_cancelled(SCSIRequest *r)
     UASRequest *req = r->hba_private;
 
     /* FIXME: queue notification to status pipe? */
+    usb_uas_release_sg(req);
     scsi_req_unref(req->req);
 }
 
+static QEMUSGList *usb_uas_scsi_get_sg_list(SCSIRequest *r)
+{
+    UASRequest *req = r->hba_private;
+
+    return req->sg_active ? &req->sg : NULL;
+}
+
 static const struct SCSIBusInfo usb_uas_scsi_info = {
     .tcq = true,
     .max_target = 0,
@@ -599,6 +624,7 @@ static const struct SCSIBusInfo usb_uas_scsi_info = {
     .transfer_data = usb_uas_scsi_transfer_data,
     .complete = usb_uas_scsi_command_complete,
     .cancel = usb_uas_scsi_request_cancelled,
+    .get_sg_list = usb_uas_scsi_get_sg_list,
     .free_request = usb_uas_scsi_free_request,
 };
 
@@ -659,6 +685,10 @@ static void usb_uas_cancel_io(USBDevice *dev, USBPacket *p)
     QTAILQ_FOREACH_SAFE(req, &uas->requests, next, nreq) {
         if (req->data == p) {
             req->data = NULL;
+            if (req->sg_active) {
+                /* the disk is transferring from / to the packet itself */
+                scsi_req_cancel(req->req);
+            }
             return;
         }
     }
@@ -695,6 +725,17 @@ static void usb_uas_command(UASDevice *uas, uas_ui *ui)
 #if 1
     scsi_req_print(req->req);
 #endif
+    /*
+     * With streams the data packet usually is there before the command,
+     * if it covers the whole transfer let the device use it directly.
+     */
+    if (req->data && req->req->cmd.xfer &&
+        (req->req->cmd.mode == SCSI_XFER_FROM_DEV) ==
+        (req->data->pid == USB_TOKEN_IN) &&
+        usb_packet_map_sglist(req->data, &req->sg, 0,
+                              req->req->cmd.xfer) == 0) {
+        req->sg_active = true;
+    }
     len = scsi_req_enqueue(req->req);
     if (len) {
         req->data_size = len;
@@ -453,9 +453,10 @@ static inline int get_dwords(EHCIState *ehci, uint32_t addr,
         return -1;
     }
 
-    for (i = 0; i < num; i++, buf++, addr += sizeof(*buf)) {
-        dma_memory_read(ehci->dma, addr, buf, sizeof(*buf));
-        *buf = le32_to_cpu(*buf);
+    /* One transaction per descriptor, the schedule walk does a lot of these */
+    dma_memory_read(ehci->dma, addr, buf, num * sizeof(*buf));
+    for (i = 0; i < num; i++) {
+        buf[i] = le32_to_cpu(buf[i]);
     }
 
     return num;
@@ -474,9 +475,13 @@ static inline int put_dwords(EHCIState *ehci, uint32_t addr,
         return -1;
     }
 
-    for (i = 0; i < num; i++, buf++, addr += sizeof(*buf)) {
-        uint32_t tmp = cpu_to_le32(*buf);
-        dma_memory_write(ehci->dma, addr, &tmp, sizeof(tmp));
+    /* Swap in place around a single write, a nop on little endian hosts */
+    for (i = 0; i < num; i++) {
+        buf[i] = cpu_to_le32(buf[i]);
+    }
+    dma_memory_write(ehci->dma, addr, buf, num * sizeof(*buf));
+    for (i = 0; i < num; i++) {
+        buf[i] = le32_to_cpu(buf[i]);
     }
 
     return num;
@@ -969,6 +974,28 @@ static uint64_t ehci_caps_read(void *ptr, hwaddr addr,
     return s->caps[addr];
 }
 
+static void ehci_update_frindex(EHCIState *ehci, int uframes);
+
+/*
+ * With the periodic schedule idle the frame timer may sleep until the next
+ * frame list rollover, so catch frindex up with vm_clock before the guest
+ * looks at it.
+ */
+static void ehci_sync_frindex(EHCIState *ehci)
+{
+    int uframes;
+
+    if (!ehci_enabled(ehci) || ehci_periodic_enabled(ehci) ||
+        ehci->pstate != EST_INACTIVE) {
+        return;
+    }
+
+    uframes = (qemu_get_clock_ns(vm_clock) - ehci->last_run_ns) /
+              UFRAME_TIMER_NS;
+    ehci_update_frindex(ehci, uframes);
+    ehci->last_run_ns += UFRAME_TIMER_NS * uframes;
+}
+
 static uint64_t ehci_opreg_read(void *ptr, hwaddr addr,
                                 unsigned size)
 {
@@ -977,6 +1004,7 @@ static uint64_t ehci_opreg_read(void *ptr, hwaddr addr,
 
     switch (addr) {
     case FRINDEX:
+        ehci_sync_frindex(s);
         /* Round down to mult of 8, else it can go backwards on migration */
         val = s->frindex & ~7;
         break;
@@ -1110,6 +1138,8 @@ static void ehci_opreg_write(void *ptr, hwaddr addr,
         if (((USBCMD_RUNSTOP | USBCMD_PSE | USBCMD_ASE) & val) !=
             ((USBCMD_RUNSTOP | USBCMD_PSE | USBCMD_ASE) & s->usbcmd)) {
             if (s->pstate == EST_INACTIVE) {
+                /* Count the uframes the idle timer has not accounted yet */
+                ehci_sync_frindex(s);
                 SET_LAST_RUN_CLOCK(s);
             }
             s->usbcmd = val; /* Set usbcmd for ehci_update_halt() */
@@ -2289,6 +2319,7 @@ static void ehci_frame_timer(void *opaque)
 {
     EHCIState *ehci = opaque;
     int need_timer = 0;
+    bool flr_only = false;
     int64_t expire_time, t_now;
     uint64_t ns_elapsed;
     int uframes, skipped_uframes;
@@ -2359,6 +2390,7 @@ static void ehci_frame_timer(void *opaque)
     }
 
     if (ehci_enabled(ehci) && (ehci->usbintr & USBSTS_FLR)) {
+        flr_only = !need_timer;
         need_timer++;
     }
 
@@ -2368,6 +2400,11 @@ static void ehci_frame_timer(void *opaque)
         if (ehci->int_req_by_async && (ehci->usbsts & USBSTS_INT)) {
             expire_time = t_now + get_ticks_per_sec() / (FRAME_TIMER_FREQ * 4);
             ehci->int_req_by_async = false;
+        } else if (flr_only) {
+            /* Nothing but the frame list rollover irq to wait for, sleep
+             * until it is due; guest FRINDEX reads catch up on their own */
+            expire_time = ehci->last_run_ns +
+                (0x2000 - (ehci->frindex & 0x1fff)) * UFRAME_TIMER_NS;
         } else {
             expire_time = t_now + (get_ticks_per_sec()
                                * (ehci->async_stepdown+1) / FRAME_TIMER_FREQ);
@@ -2419,6 +2456,8 @@ static void usb_ehci_pre_save(void *opaque)
     EHCIState *ehci = opaque;
     uint32_t new_frindex;
 
+    ehci_sync_frindex(ehci);
+
     /* Round down frindex to a multiple of 8 for migration compatibility */
     new_frindex = ehci->frindex & ~7;
     ehci->last_run_ns -= (ehci->frindex - new_frindex) * UFRAME_TIMER_NS;
@@ -79,6 +79,11 @@
 #define QH_VALID         32
 
 #define MAX_FRAMES_PER_TICK    (QH_VALID / 2)
+/* Keep idle ticks well below MAX_FRAMES_PER_TICK so timer jitter does not
+ * leave frames behind, and bound the delay for newly queued TDs.  The timer
+ * never stops while RS is set: without a doorbell, new TDs only show up in
+ * the frame list, and the guest may wait for a frame interrupt. */
+#define MAX_IDLE_STEPDOWN      (MAX_FRAMES_PER_TICK / 4 - 1)
 
 #define NB_PORTS 2
 
@@ -159,6 +164,8 @@ struct UHCIState {
     uint32_t frame_bytes;
     uint32_t frame_bandwidth;
     bool completions_only;
+    bool frame_active;      /* an active TD was seen since the last tick */
+    uint32_t idle_stepdown; /* extra frames to sleep while the schedule is idle */
     UHCIPort ports[NB_PORTS];
 
     /* Interrupts that should be raised at the end of the current frame.  */
@@ -462,6 +469,40 @@ static const VMStateDescription vmstate_uhci = {
     }
 };
 
+/*
+ * The guest did something, go back to ticking every frame, starting with
+ * the next frame which is due.
+ */
+static void uhci_idle_exit(UHCIState *s)
+{
+    if (s->idle_stepdown && (s->cmd & UHCI_CMD_RS)) {
+        s->idle_stepdown = 0;
+        qemu_mod_timer(s->frame_timer, s->expire_time);
+    }
+}
+
+/*
+ * While idling the timer runs frames in batches, so frnum may lag behind
+ * vm_clock.  Report the frame which is current without running the
+ * schedule, the timer will process the frames in between later on.
+ */
+static uint32_t uhci_current_frnum(UHCIState *s)
+{
+    const uint64_t frame_t = get_ticks_per_sec() / FRAME_TIMER_FREQ;
+    uint64_t t_last_run, t_now;
+
+    if (!s->idle_stepdown || !(s->cmd & UHCI_CMD_RS)) {
+        return s->frnum;
+    }
+
+    t_last_run = s->expire_time - frame_t;
+    t_now = qemu_get_clock_ns(vm_clock);
+    if (t_now <= t_last_run) {
+        return s->frnum;
+    }
+    return (s->frnum + (t_now - t_last_run) / frame_t) & 0x7ff;
+}
+
 static void uhci_port_write(void *opaque, hwaddr addr,
                             uint64_t val, unsigned size)
 {
@@ -469,6 +510,8 @@ static void uhci_port_write(void *opaque, hwaddr addr,
 
     trace_usb_uhci_mmio_writew(addr, val);
 
+    uhci_idle_exit(s);
+
     switch(addr) {
     case 0x00:
         if ((val & UHCI_CMD_RS) && !(s->cmd & UHCI_CMD_RS)) {
@@ -476,6 +519,7 @@ static void uhci_port_write(void *opaque, hwaddr addr,
             trace_usb_uhci_schedule_start();
             s->expire_time = qemu_get_clock_ns(vm_clock) +
                 (get_ticks_per_sec() / FRAME_TIMER_FREQ);
+            s->idle_stepdown = 0;
             qemu_mod_timer(s->frame_timer, s->expire_time);
             s->status &= ~UHCI_STS_HCHALTED;
         } else if (!(val & UHCI_CMD_RS)) {
@@ -573,7 +617,9 @@ static uint64_t uhci_port_read(void *opaque, hwaddr addr, unsigned size)
         val = s->intr;
         break;
     case 0x06:
-        val = s->frnum;
+        val = uhci_current_frnum(s);
+        /* The guest is polling, pick up its TDs without delay */
+        uhci_idle_exit(s);
         break;
     case 0x08:
         val = s->fl_base_addr & 0xffff;
@@ -940,6 +986,8 @@ static void uhci_async_complete(USBPort *port, USBPacket *packet)
     /* Force processing of this packet *now*, needed for migration */
     s->completions_only = true;
     qemu_bh_schedule(s->bh);
+    /* And don't sit on the completion irq while idling */
+    uhci_idle_exit(s);
 }
 
 static int is_valid(uint32_t link)
@@ -1081,6 +1129,9 @@ static void uhci_process_frame(UHCIState *s)
         trace_usb_uhci_td_load(curr_qh & ~0xf, link & ~0xf, td.ctrl, td.token);
 
         old_td_ctrl = td.ctrl;
+        if (old_td_ctrl & TD_CTRL_ACTIVE) {
+            s->frame_active = true;
+        }
         ret = uhci_handle_td(s, NULL, curr_qh, &td, link, &int_mask);
         if (old_td_ctrl != td.ctrl) {
             /* update the status bits of the TD */
@@ -1196,7 +1247,19 @@ static void uhci_frame_timer(void *opaque)
     }
     s->pending_int_mask = 0;
 
-    qemu_mod_timer(s->frame_timer, t_now + frame_t);
+    /*
+     * Nothing for the guest in the schedule, slow down the timer.  Frames
+     * keep their timing through expire_time, we only process them in
+     * bigger batches, at most MAX_FRAMES_PER_TICK at a time.
+     */
+    if (s->frame_active || !QTAILQ_EMPTY(&s->queues)) {
+        s->idle_stepdown = 0;
+    } else if (s->idle_stepdown < MAX_IDLE_STEPDOWN) {
+        s->idle_stepdown++;
+    }
+    s->frame_active = false;
+
+    qemu_mod_timer(s->frame_timer, t_now + frame_t * (s->idle_stepdown + 1));
 }
 
 static const MemoryRegionOps uhci_ioport_ops = {
@@ -24,6 +24,8 @@
 #include "hw/pci/pci.h"
 #include "hw/pci/msi.h"
 #include "hw/pci/msix.h"
+#include "qemu/event_notifier.h"
+#include "sysemu/kvm.h"
 #include "trace.h"
 
 //#define DEBUG_XHCI
@@ -45,6 +47,7 @@
 #define MAXINTRS 16
 
 #define TD_QUEUE 24
+#define TRB_PREFETCH 16
 
 /* Very pessimistic, let's hope it's enough for all cases */
 #define EV_QUEUE (((3*TD_QUEUE)+16)*MAXSLOTS)
@@ -137,6 +140,9 @@
 
 #define ERDP_EHB        (1<<3)
 
+#define IMODI_MASK      0x0000ffff
+#define IMODI_NS        250
+
 #define TRB_SIZE 16
 typedef struct XHCITRB {
     uint64_t parameter;
@@ -401,6 +407,11 @@ struct XHCIEPContext {
     unsigned int interval;
     int64_t mfindex_last;
     QEMUTimer *kick_timer;
+
+    /* doorbell ioeventfd */
+    EventNotifier doorbell;
+    bool doorbell_started;
+    bool doorbell_eventfd;  /* bound in KVM, else set by the MMIO handler */
 };
 
 typedef struct XHCISlot {
@@ -421,6 +432,7 @@ typedef struct XHCIEvent {
 } XHCIEvent;
 
 typedef struct XHCIInterrupter {
+    XHCIState *xhci;
     uint32_t iman;
     uint32_t imod;
     uint32_t erstsz;
@@ -439,8 +451,21 @@ typedef struct XHCIInterrupter {
     unsigned int ev_buffer_put;
     unsigned int ev_buffer_get;
 
+    /* interrupt moderation (IMOD) */
+    QEMUTimer *imod_timer;
+    int64_t imod_deadline;
+    bool imod_pending;
 } XHCIInterrupter;
 
+/* TRBs read ahead of the dequeue pointer of one ring, see xhci_ring_read */
+typedef struct XHCITRBCache {
+    const XHCIRing *ring;
+    dma_addr_t addr;
+    bool ccs;
+    unsigned int count;
+    uint8_t trbs[TRB_PREFETCH * TRB_SIZE];
+} XHCITRBCache;
+
 struct XHCIState {
     PCIDevice pci_dev;
     USBBus bus;
@@ -479,6 +504,7 @@ struct XHCIState {
     XHCIInterrupter intr[MAXINTRS];
 
     XHCIRing cmd_ring;
+    XHCITRBCache trb_cache;
 };
 
 typedef struct XHCIEvRingSeg {
@@ -491,6 +517,7 @@ typedef struct XHCIEvRingSeg {
 enum xhci_flags {
     XHCI_FLAG_USE_MSI = 1,
     XHCI_FLAG_USE_MSI_X,
+    XHCI_FLAG_IOEVENTFD,
 };
 
 static void xhci_kick_ep(XHCIState *xhci, unsigned int slotid,
@@ -739,12 +766,8 @@ static void xhci_msix_update(XHCIState *xhci, int v)
     }
 }
 
-static void xhci_intr_raise(XHCIState *xhci, int v)
+static void xhci_intr_notify(XHCIState *xhci, int v)
 {
-    xhci->intr[v].erdp_low |= ERDP_EHB;
-    xhci->intr[v].iman |= IMAN_IP;
-    xhci->usbsts |= USBSTS_EINT;
-
     if (!(xhci->intr[v].iman & IMAN_IE)) {
         return;
     }
@@ -771,6 +794,77 @@ static void xhci_intr_raise(XHCIState *xhci, int v)
     }
 }
 
+static void xhci_intr_raise(XHCIState *xhci, int v)
+{
+    XHCIInterrupter *intr = &xhci->intr[v];
+    bool busy = intr->erdp_low & ERDP_EHB;
+    int64_t now;
+
+    intr->erdp_low |= ERDP_EHB;
+    intr->iman |= IMAN_IP;
+    xhci->usbsts |= USBSTS_EINT;
+
+    /*
+     * The guest has not yet acked the previous interrupt by clearing EHB,
+     * its handler will pick this event up as well (4.17.2).  If it has
+     * already left the handler, xhci_intr_rearm() catches that.
+     */
+    if (busy) {
+        return;
+    }
+
+    if (intr->imod & IMODI_MASK) {
+        now = qemu_get_clock_ns(vm_clock);
+        if (now < intr->imod_deadline) {
+            if (!intr->imod_pending) {
+                intr->imod_pending = true;
+                qemu_mod_timer(intr->imod_timer, intr->imod_deadline);
+            }
+            return;
+        }
+        intr->imod_deadline = now + (intr->imod & IMODI_MASK) * IMODI_NS;
+    }
+
+    xhci_intr_notify(xhci, v);
+}
+
+static void xhci_imod_timer(void *opaque)
+{
+    XHCIInterrupter *intr = opaque;
+    XHCIState *xhci = intr->xhci;
+
+    intr->imod_pending = false;
+    if (!(intr->iman & IMAN_IP)) {
+        /* the guest found the events on its own in the meantime */
+        return;
+    }
+    intr->imod_deadline = qemu_get_clock_ns(vm_clock) +
+        (intr->imod & IMODI_MASK) * IMODI_NS;
+    xhci_intr_notify(xhci, intr - xhci->intr);
+}
+
+/* Events the guest hasn't seen when it clears EHB need a new interrupt */
+static void xhci_intr_rearm(XHCIState *xhci, int v)
+{
+    XHCIInterrupter *intr = &xhci->intr[v];
+    dma_addr_t erdp;
+
+    if ((intr->erdp_low & ERDP_EHB) || intr->er_size == 0) {
+        return;
+    }
+
+    erdp = xhci_addr64(intr->erdp_low, intr->erdp_high);
+    if (erdp < intr->er_start ||
+        erdp >= (intr->er_start + TRB_SIZE*intr->er_size)) {
+        /* possibly half written, xhci_events_update() complains if not */
+        return;
+    }
+
+    if ((erdp - intr->er_start) / TRB_SIZE != intr->er_ep_idx) {
+        xhci_intr_raise(xhci, v);
+    }
+}
+
 static inline int xhci_running(XHCIState *xhci)
 {
     return !(xhci->usbsts & USBSTS_HCH) && !xhci->intr[0].er_full;
@@ -939,24 +1033,79 @@ static void xhci_event(XHCIState *xhci, XHCIEvent *event, int v)
     xhci_intr_raise(xhci, v);
 }
 
+static void xhci_trb_cache_invalidate(XHCIState *xhci)
+{
+    xhci->trb_cache.ring = NULL;
+    xhci->trb_cache.count = 0;
+}
+
 static void xhci_ring_init(XHCIState *xhci, XHCIRing *ring,
                            dma_addr_t base)
 {
+    if (xhci->trb_cache.ring == ring) {
+        xhci_trb_cache_invalidate(xhci);
+    }
     ring->dequeue = base;
     ring->ccs = 1;
 }
 
+static void xhci_trb_load(XHCITRB *trb, const uint8_t *buf)
+{
+    trb->parameter = ldq_le_p(buf);
+    trb->status = ldl_le_p(buf + 8);
+    trb->control = ldl_le_p(buf + 12);
+}
+
+/*
+ * Read the TRB at addr on ring, expecting cycle state ccs.
+ *
+ * On a miss this reads ahead up to TRB_PREFETCH TRBs (without crossing a
+ * page) in one go and keeps those which are already owned by the xHC, up
+ * to and including the first link TRB.  The guest must not touch those
+ * until we've consumed them, so the copy stays good for the duration of
+ * an endpoint kick or a command ring run, which is as long as we keep it.
+ */
+static void xhci_ring_read(XHCIState *xhci, const XHCIRing *ring,
+                           dma_addr_t addr, bool ccs, XHCITRB *trb)
+{
+    XHCITRBCache *cache = &xhci->trb_cache;
+    unsigned int i, n;
+
+    if (cache->ring == ring && cache->ccs == ccs && addr >= cache->addr &&
+        addr < cache->addr + cache->count * TRB_SIZE) {
+        xhci_trb_load(trb, cache->trbs + (addr - cache->addr));
+        return;
+    }
+
+    n = MIN(TRB_PREFETCH, (4096 - (addr & 4095)) / TRB_SIZE);
+    pci_dma_read(&xhci->pci_dev, addr, cache->trbs, n * TRB_SIZE);
+
+    cache->ring = ring;
+    cache->addr = addr;
+    cache->ccs = ccs;
+    for (i = 0; i < n; i++) {
+        xhci_trb_load(trb, cache->trbs + i * TRB_SIZE);
+        if ((trb->control & TRB_C) != ccs) {
+            break;
+        }
+        if (TRB_TYPE(*trb) == TR_LINK) {
+            i++;
+            break;
+        }
+    }
+    cache->count = i;
+
+    xhci_trb_load(trb, cache->trbs);
+}
+
 static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
                                dma_addr_t *addr)
 {
     while (1) {
         TRBType type;
-        pci_dma_read(&xhci->pci_dev, ring->dequeue, trb, TRB_SIZE);
+        xhci_ring_read(xhci, ring, ring->dequeue, ring->ccs, trb);
         trb->addr = ring->dequeue;
         trb->ccs = ring->ccs;
-        le64_to_cpus(&trb->parameter);
-        le32_to_cpus(&trb->status);
-        le32_to_cpus(&trb->control);
 
         trace_usb_xhci_fetch_trb(ring->dequeue, trb_name(trb),
                                  trb->parameter, trb->status, trb->control);
@@ -993,10 +1142,7 @@ static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
 
     while (1) {
         TRBType type;
-        pci_dma_read(&xhci->pci_dev, dequeue, &trb, TRB_SIZE);
-        le64_to_cpus(&trb.parameter);
-        le32_to_cpus(&trb.status);
-        le32_to_cpus(&trb.control);
+        xhci_ring_read(xhci, ring, dequeue, ccs, &trb);
 
         if ((trb.control & TRB_C) != ccs) {
             return -length;
@@ -1197,6 +1343,85 @@ static void xhci_ep_kick_timer(void *opaque)
     xhci_kick_ep(epctx->xhci, epctx->slotid, epctx->epid, 0);
 }
 
+static void xhci_ep_doorbell_handler(EventNotifier *e)
+{
+    XHCIEPContext *epctx = container_of(e, XHCIEPContext, doorbell);
+    XHCIState *xhci = epctx->xhci;
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+    if (!xhci_running(xhci)) {
+        return;
+    }
+    xhci_kick_ep(xhci, epctx->slotid, epctx->epid, 0);
+}
+
+/*
+ * Bind the endpoint doorbell to an ioeventfd, so that a guest ringing it
+ * only costs a lightweight exit and the ring itself is walked from the
+ * main loop instead of the vcpu thread.  Without KVM ioeventfds the MMIO
+ * handler sets the notifier itself.  Stream endpoints need the stream id
+ * from the written value and are always kicked from xhci_doorbell_write.
+ */
+static void xhci_ep_doorbell_start(XHCIState *xhci, XHCIEPContext *epctx)
+{
+    if (!(xhci->flags & (1 << XHCI_FLAG_IOEVENTFD)) || epctx->max_pstreams) {
+        return;
+    }
+    if (event_notifier_init(&epctx->doorbell, 0) < 0) {
+        fprintf(stderr, "xhci: failed to create doorbell notifier\n");
+        return;
+    }
+    if (kvm_enabled() && kvm_has_many_ioeventfds()) {
+        memory_region_add_eventfd(&xhci->mem_doorbell, epctx->slotid << 2, 4,
+                                  true, epctx->epid, &epctx->doorbell);
+        epctx->doorbell_eventfd = true;
+    }
+    event_notifier_set_handler(&epctx->doorbell, xhci_ep_doorbell_handler);
+    epctx->doorbell_started = true;
+}
+
+static void xhci_ep_doorbell_stop(XHCIState *xhci, XHCIEPContext *epctx)
+{
+    if (!epctx->doorbell_started) {
+        return;
+    }
+    if (epctx->doorbell_eventfd) {
+        memory_region_del_eventfd(&xhci->mem_doorbell, epctx->slotid << 2, 4,
+                                  true, epctx->epid, &epctx->doorbell);
+        epctx->doorbell_eventfd = false;
+    }
+    event_notifier_set_handler(&epctx->doorbell, NULL);
+    event_notifier_cleanup(&epctx->doorbell);
+    epctx->doorbell_started = false;
+}
+
+/*
+ * Kick the endpoints whose doorbells were rung but not serviced yet.  A
+ * command must not overtake an earlier doorbell: a late kick after Stop
+ * Endpoint would set the endpoint running again and run the TDs the guest
+ * meant to cancel.
+ */
+static void xhci_ep_doorbells_flush(XHCIState *xhci)
+{
+    XHCIEPContext *epctx;
+    int i, j;
+
+    for (i = 0; i < xhci->numslots; i++) {
+        if (!xhci->slots[i].enabled) {
+            continue;
+        }
+        for (j = 0; j < 31; j++) {
+            epctx = xhci->slots[i].eps[j];
+            if (epctx && epctx->doorbell_started &&
+                event_notifier_test_and_clear(&epctx->doorbell)) {
+                xhci_kick_ep(xhci, i + 1, j + 1, 0);
+            }
+        }
+    }
+}
+
 static TRBCCode xhci_enable_ep(XHCIState *xhci, unsigned int slotid,
                                unsigned int epid, dma_addr_t pctx,
                                uint32_t *ctx)
@@ -1247,6 +1472,7 @@ static TRBCCode xhci_enable_ep(XHCIState *xhci, unsigned int slotid,
     epctx->interval = 1 << (ctx[0] >> 16) & 0xff;
     epctx->mfindex_last = 0;
     epctx->kick_timer = qemu_new_timer_ns(vm_clock, xhci_ep_kick_timer, epctx);
+    xhci_ep_doorbell_start(xhci, epctx);
 
     epctx->state = EP_RUNNING;
     ctx[0] &= ~EP_STATE_MASK;
@@ -1346,6 +1572,7 @@ static TRBCCode xhci_disable_ep(XHCIState *xhci, unsigned int slotid,
 
     xhci_set_ep_state(xhci, epctx, NULL, EP_DISABLED);
 
+    xhci_ep_doorbell_stop(xhci, epctx);
     qemu_free_timer(epctx->kick_timer);
     g_free(epctx);
     slot->eps[epid-1] = NULL;
@@ -1937,7 +2164,8 @@ static void xhci_kick_ep(XHCIState *xhci, unsigned int slotid,
         return;
     }
 
-
+    /* the guest may have queued TRBs since the last kick */
+    xhci_trb_cache_invalidate(xhci);
     if (epctx->nr_pstreams) {
         uint32_t err;
         stctx = xhci_find_stream(epctx, streamid, &err);
@@ -2467,7 +2695,10 @@ static void xhci_process_commands(XHCIState *xhci)
         return;
     }
 
+    xhci_ep_doorbells_flush(xhci);
+
     xhci->crcr_low |= CRCR_CRR;
+    xhci_trb_cache_invalidate(xhci);
 
     while ((type = xhci_ring_fetch(xhci, &xhci->cmd_ring, &trb, &addr))) {
         event.ptr = addr;
@@ -2701,7 +2932,12 @@ static void xhci_reset(DeviceState *dev)
         xhci->intr[i].er_full = 0;
         xhci->intr[i].ev_buffer_put = 0;
         xhci->intr[i].ev_buffer_get = 0;
+
+        qemu_del_timer(xhci->intr[i].imod_timer);
+        xhci->intr[i].imod_deadline = 0;
+        xhci->intr[i].imod_pending = false;
     }
+    xhci_trb_cache_invalidate(xhci);
 
     xhci->mfindex_start = qemu_get_clock_ns(vm_clock);
     xhci_mfwrap_update(xhci);
@@ -3055,10 +3291,12 @@ static void xhci_runtime_write(void *ptr, hwaddr reg,
             intr->erdp_low &= ~ERDP_EHB;
         }
         intr->erdp_low = (val & ~ERDP_EHB) | (intr->erdp_low & ERDP_EHB);
+        xhci_intr_rearm(xhci, v);
         break;
     case 0x1c: /* ERDP high */
         intr->erdp_high = val;
         xhci_events_update(xhci, v);
+        xhci_intr_rearm(xhci, v);
         break;
     default:
         trace_usb_xhci_unimplemented("oper write", reg);
@@ -3077,6 +3315,7 @@ static void xhci_doorbell_write(void *ptr, hwaddr reg,
                                 uint64_t val, unsigned size)
 {
     XHCIState *xhci = ptr;
+    XHCIEPContext *epctx;
     unsigned int epid, streamid;
 
     trace_usb_xhci_doorbell_write(reg, val);
@@ -3104,7 +3343,14 @@ static void xhci_doorbell_write(void *ptr, hwaddr reg,
             fprintf(stderr, "xhci: bad doorbell %d write: 0x%x\n",
                     (int)reg, (uint32_t)val);
         } else {
-            xhci_kick_ep(xhci, reg, epid, streamid);
+            epctx = epid && xhci->slots[reg - 1].enabled ?
+                    xhci->slots[reg - 1].eps[epid - 1] : NULL;
+            if (epctx && epctx->doorbell_started && val == epid) {
+                /* what the ioeventfd would have done */
+                event_notifier_set(&epctx->doorbell);
+            } else {
+                xhci_kick_ep(xhci, reg, epid, streamid);
+            }
         }
     }
 }
@@ -3319,6 +3565,11 @@ static int usb_xhci_initfn(struct PCIDevice *dev)
     }
 
     xhci->mfwrap_timer = qemu_new_timer_ns(vm_clock, xhci_mfwrap_timer, xhci);
+    for (i = 0; i < MAXINTRS; i++) {
+        xhci->intr[i].xhci = xhci;
+        xhci->intr[i].imod_timer = qemu_new_timer_ns(vm_clock, xhci_imod_timer,
+                                                     &xhci->intr[i]);
+    }
 
     xhci->irq = xhci->pci_dev.irq[0];
 
@@ -3374,6 +3625,7 @@ static const VMStateDescription vmstate_xhci = {
 static Property xhci_properties[] = {
     DEFINE_PROP_BIT("msi",      XHCIState, flags, XHCI_FLAG_USE_MSI, true),
     DEFINE_PROP_BIT("msix",     XHCIState, flags, XHCI_FLAG_USE_MSI_X, true),
+    DEFINE_PROP_BIT("ioeventfd", XHCIState, flags, XHCI_FLAG_IOEVENTFD, false),
     DEFINE_PROP_UINT32("intrs", XHCIState, numintrs, MAXINTRS),
     DEFINE_PROP_UINT32("slots", XHCIState, numslots, MAXSLOTS),
     DEFINE_PROP_UINT32("p2",    XHCIState, numports_2, 4),
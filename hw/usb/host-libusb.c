@@ -760,6 +760,10 @@ static void usb_host_ep_update(USBHostDevice *s)
             usb_ep_set_type(udev, pid, ep, type);
             usb_ep_set_ifnum(udev, pid, ep, i);
             usb_ep_set_halted(udev, pid, ep, 0);
+            if (type == LIBUSB_TRANSFER_TYPE_BULK &&
+                (s->options & (1 << USB_HOST_OPT_PIPELINE))) {
+                usb_ep_set_pipeline(udev, pid, ep, true);
+            }
         }
     }
 
@@ -28,6 +28,8 @@ int usb_packet_map(USBPacket *p, QEMUSGList *sgl)
 {
     DMADirection dir = (p->pid == USB_TOKEN_IN) ?
         DMA_DIRECTION_FROM_DEVICE : DMA_DIRECTION_TO_DEVICE;
+    ram_addr_t ram_addr;
+    bool direct = true;
     void *mem;
     int i;
 
@@ -41,6 +43,10 @@ int usb_packet_map(USBPacket *p, QEMUSGList *sgl)
             if (!mem) {
                 goto err;
             }
+            /* Anything but guest RAM comes back in the bounce buffer */
+            if (qemu_ram_addr_from_host(mem, &ram_addr) != 0) {
+                direct = false;
+            }
             if (xlen > len) {
                 xlen = len;
             }
@@ -49,6 +55,7 @@ int usb_packet_map(USBPacket *p, QEMUSGList *sgl)
             base += xlen;
         }
     }
+    p->sgl = direct ? sgl : NULL;
     return 0;
 
 err:
@@ -67,4 +74,45 @@ void usb_packet_unmap(USBPacket *p, QEMUSGList *sgl)
                          p->iov.iov[i].iov_len, dir,
                          p->iov.iov[i].iov_len);
     }
+    p->sgl = NULL;
+}
+
+/*
+ * Build a scatter/gather list for len bytes of the packet's guest memory,
+ * starting offset bytes into the packet, so a device can have the block
+ * layer transfer straight to / from the packet instead of copying it
+ * through a bounce buffer.  Fails unless the host controller mapped the
+ * packet with usb_packet_map() and all of it is guest RAM.  A bounce
+ * buffer would be copied back over the transferred data on unmap.
+ */
+int usb_packet_map_sglist(USBPacket *p, QEMUSGList *qsg,
+                          size_t offset, size_t len)
+{
+    QEMUSGList *sgl = p->sgl;
+    int i;
+
+    if (sgl == NULL || sgl->size != p->iov.size ||
+        offset + len > sgl->size) {
+        return -1;
+    }
+
+    qemu_sglist_init(qsg, sgl->nsg, sgl->dma);
+    for (i = 0; i < sgl->nsg && len; i++) {
+        dma_addr_t base = sgl->sg[i].base;
+        dma_addr_t xlen = sgl->sg[i].len;
+
+        if (offset >= xlen) {
+            offset -= xlen;
+            continue;
+        }
+        base += offset;
+        xlen -= offset;
+        offset = 0;
+        if (xlen > len) {
+            xlen = len;
+        }
+        qemu_sglist_add(qsg, base, xlen);
+        len -= xlen;
+    }
+    return 0;
 }
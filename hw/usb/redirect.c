@@ -42,6 +42,7 @@
 
 #define MAX_ENDPOINTS 32
 #define NO_INTERFACE_INFO 255 /* Valid interface_count always <= 32 */
+#define BUFP_POOL_MAX 256 /* Max number of spare buf_packets kept per ep */
 #define EP2I(ep_address) (((ep_address & 0x80) >> 3) | (ep_address & 0x0f))
 #define I2EP(i) (((i & 0x10) << 3) | (i & 0x0f))
 #define USBEP2I(usb_ep) (((usb_ep)->pid == USB_TOKEN_IN) ? \
@@ -79,6 +80,8 @@ struct endp_data {
     QTAILQ_HEAD(, buf_packet) bufpq;
     int32_t bufpq_size;
     int32_t bufpq_target_size;
+    QTAILQ_HEAD(, buf_packet) bufp_pool; /* Spare buf_packets for reuse */
+    int32_t bufp_pool_size;
     USBPacket *pending_async_packet;
 };
 
@@ -108,6 +111,10 @@ struct USBRedirDevice {
     guint watch;
     /* For async handling of close */
     QEMUBH *chardev_close_bh;
+    /* To coalesce the writes of packets queued from one main loop pass */
+    QEMUBH *write_bh;
+    GByteArray *write_buf;
+    bool write_gather;
     /* To delay the usb attach in case of quick chardev close + open */
     QEMUTimer *attach_timer;
     int64_t next_attach_time;
@@ -256,13 +263,44 @@ static int usbredir_read(void *priv, uint8_t *data, int count)
     return count;
 }
 
+static gboolean usbredir_write_unblocked(GIOChannel *chan, GIOCondition cond,
+                                         void *opaque);
+static void usbredir_write_bh(void *opaque);
+
+/* Send what usbredir_write_bh() gathered, returns true once all is gone */
+static bool usbredir_write_gathered(USBRedirDevice *dev)
+{
+    int r;
+
+    if (!dev->write_buf->len) {
+        return true;
+    }
+    /* Like the parser's own queue, it waits until our state is synced */
+    if (!runstate_check(RUN_STATE_RUNNING)) {
+        return false;
+    }
+
+    r = qemu_chr_fe_write(dev->cs, dev->write_buf->data, dev->write_buf->len);
+    if (r > 0) {
+        g_byte_array_remove_range(dev->write_buf, 0, r);
+    }
+    if (dev->write_buf->len) {
+        if (!dev->watch) {
+            dev->watch = qemu_chr_fe_add_watch(dev->cs, G_IO_OUT,
+                                               usbredir_write_unblocked, dev);
+        }
+        return false;
+    }
+    return true;
+}
+
 static gboolean usbredir_write_unblocked(GIOChannel *chan, GIOCondition cond,
                                          void *opaque)
 {
     USBRedirDevice *dev = opaque;
 
     dev->watch = 0;
-    usbredirparser_do_write(dev->parser);
+    usbredir_write_bh(dev);
 
     return FALSE;
 }
@@ -281,6 +319,16 @@ static int usbredir_write(void *priv, uint8_t *data, int count)
         return 0;
     }
 
+    if (dev->write_gather) {
+        g_byte_array_append(dev->write_buf, data, count);
+        return count;
+    }
+
+    /* Gathered data which didn't fit into the chardev goes first */
+    if (!usbredir_write_gathered(dev)) {
+        return 0;
+    }
+
     r = qemu_chr_fe_write(dev->cs, data, count);
     if (r < count) {
         if (!dev->watch) {
@@ -294,6 +342,31 @@ static int usbredir_write(void *priv, uint8_t *data, int count)
     return r;
 }
 
+static void usbredir_write_bh(void *opaque)
+{
+    USBRedirDevice *dev = opaque;
+
+    if (!dev->parser || !usbredir_write_gathered(dev)) {
+        return;
+    }
+    dev->write_gather = true;
+    usbredirparser_do_write(dev->parser);
+    dev->write_gather = false;
+    usbredir_write_gathered(dev);
+}
+
+/*
+ * Data packets get queued in the parser and flushed to the chardev from a
+ * bh.  The bh gathers everything the parser has queued into write_buf and
+ * hands it to the chardev in a single write, so all packets submitted by
+ * the HC in one go (ie a whole frame worth of iso / interrupt / bulk
+ * packets) cost one write instead of one per packet.
+ */
+static void usbredir_schedule_write(USBRedirDevice *dev)
+{
+    qemu_bh_schedule(dev->write_bh);
+}
+
 /*
  * Cancelled and buffered packets helpers
  */
@@ -460,7 +533,13 @@ static void bufp_alloc(USBRedirDevice *dev, uint8_t *data, uint16_t len,
         dev->endpoint[EP2I(ep)].bufpq_dropping_packets = 0;
     }
 
-    bufp = g_malloc(sizeof(struct buf_packet));
+    bufp = QTAILQ_FIRST(&dev->endpoint[EP2I(ep)].bufp_pool);
+    if (bufp) {
+        QTAILQ_REMOVE(&dev->endpoint[EP2I(ep)].bufp_pool, bufp, next);
+        dev->endpoint[EP2I(ep)].bufp_pool_size--;
+    } else {
+        bufp = g_malloc(sizeof(struct buf_packet));
+    }
     bufp->data   = data;
     bufp->len    = len;
     bufp->offset = 0;
@@ -476,7 +555,12 @@ static void bufp_free(USBRedirDevice *dev, struct buf_packet *bufp,
     QTAILQ_REMOVE(&dev->endpoint[EP2I(ep)].bufpq, bufp, next);
     dev->endpoint[EP2I(ep)].bufpq_size--;
     free(bufp->free_on_destroy);
-    g_free(bufp);
+    if (dev->endpoint[EP2I(ep)].bufp_pool_size < BUFP_POOL_MAX) {
+        QTAILQ_INSERT_HEAD(&dev->endpoint[EP2I(ep)].bufp_pool, bufp, next);
+        dev->endpoint[EP2I(ep)].bufp_pool_size++;
+    } else {
+        g_free(bufp);
+    }
 }
 
 static void usbredir_free_bufpq(USBRedirDevice *dev, uint8_t ep)
@@ -488,6 +572,18 @@ static void usbredir_free_bufpq(USBRedirDevice *dev, uint8_t ep)
     }
 }
 
+static void usbredir_free_bufp_pool(USBRedirDevice *dev, uint8_t ep)
+{
+    struct buf_packet *buf, *buf_next;
+
+    QTAILQ_FOREACH_SAFE(buf, &dev->endpoint[EP2I(ep)].bufp_pool, next,
+                        buf_next) {
+        QTAILQ_REMOVE(&dev->endpoint[EP2I(ep)].bufp_pool, buf, next);
+        g_free(buf);
+    }
+    dev->endpoint[EP2I(ep)].bufp_pool_size = 0;
+}
+
 /*
  * USBDevice callbacks
  */
@@ -543,7 +639,7 @@ static void usbredir_handle_iso_data(USBRedirDevice *dev, USBPacket *p,
 
         /* No id, we look at the ep when receiving a status back */
         usbredirparser_send_start_iso_stream(dev->parser, 0, &start_iso);
-        usbredirparser_do_write(dev->parser);
+        usbredir_schedule_write(dev);
         DPRINTF("iso stream started pkts/sec %d pkts/urb %d urbs %d ep %02X\n",
                 pkts_per_sec, start_iso.pkts_per_urb, start_iso.no_urbs, ep);
         dev->endpoint[EP2I(ep)].iso_started = 1;
@@ -602,7 +698,7 @@ static void usbredir_handle_iso_data(USBRedirDevice *dev, USBPacket *p,
             usb_packet_copy(p, buf, p->iov.size);
             usbredirparser_send_iso_packet(dev->parser, 0, &iso_packet,
                                            buf, p->iov.size);
-            usbredirparser_do_write(dev->parser);
+            usbredir_schedule_write(dev);
         }
         status = dev->endpoint[EP2I(ep)].iso_error;
         dev->endpoint[EP2I(ep)].iso_error = 0;
@@ -723,7 +819,7 @@ static void usbredir_handle_buffered_bulk_in_data(USBRedirDevice *dev,
         start.bytes_per_transfer = bpt;
         /* No id, we look at the ep when receiving a status back */
         usbredirparser_send_start_bulk_receiving(dev->parser, 0, &start);
-        usbredirparser_do_write(dev->parser);
+        usbredir_schedule_write(dev);
         DPRINTF("bulk receiving started bytes/transfer %u count %d ep %02X\n",
                 start.bytes_per_transfer, start.no_transfers, ep);
         dev->endpoint[EP2I(ep)].bulk_receiving_started = 1;
@@ -800,7 +896,7 @@ static void usbredir_handle_bulk_data(USBRedirDevice *dev, USBPacket *p,
         usbredirparser_send_bulk_packet(dev->parser, p->id,
                                         &bulk_packet, buf, size);
     }
-    usbredirparser_do_write(dev->parser);
+    usbredir_schedule_write(dev);
     p->status = USB_RET_ASYNC;
 }
 
@@ -819,7 +915,7 @@ static void usbredir_handle_interrupt_in_data(USBRedirDevice *dev,
         /* No id, we look at the ep when receiving a status back */
         usbredirparser_send_start_interrupt_receiving(dev->parser, 0,
                                                       &start_int);
-        usbredirparser_do_write(dev->parser);
+        usbredir_schedule_write(dev);
         DPRINTF("interrupt recv started ep %02X\n", ep);
         dev->endpoint[EP2I(ep)].interrupt_started = 1;
         /* We don't really want to drop interrupt packets ever, but
@@ -879,7 +975,7 @@ static void usbredir_handle_interrupt_out_data(USBRedirDevice *dev,
     usbredir_log_data(dev, "interrupt data out:", buf, p->iov.size);
     usbredirparser_send_interrupt_packet(dev->parser, p->id,
                                     &interrupt_packet, buf, p->iov.size);
-    usbredirparser_do_write(dev->parser);
+    usbredir_schedule_write(dev);
 }
 
 static void usbredir_stop_interrupt_receiving(USBRedirDevice *dev,
@@ -1113,6 +1209,7 @@ static void usbredir_chardev_close_bh(void *opaque)
         g_source_remove(dev->watch);
         dev->watch = 0;
     }
+    g_byte_array_set_size(dev->write_buf, 0);
 }
 
 static void usbredir_create_parser(USBRedirDevice *dev)
@@ -1259,7 +1356,7 @@ static void usbredir_vm_state_change(void *priv, int running, RunState state)
     USBRedirDevice *dev = priv;
 
     if (state == RUN_STATE_RUNNING && dev->parser != NULL) {
-        usbredirparser_do_write(dev->parser); /* Flush any pending writes */
+        usbredir_write_bh(dev); /* Flush any pending writes */
     }
 }
 
@@ -1272,6 +1369,7 @@ static void usbredir_init_endpoints(USBRedirDevice *dev)
     for (i = 0; i < MAX_ENDPOINTS; i++) {
         dev->endpoint[i].dev = dev;
         QTAILQ_INIT(&dev->endpoint[i].bufpq);
+        QTAILQ_INIT(&dev->endpoint[i].bufp_pool);
     }
 }
 
@@ -1297,6 +1395,8 @@ static int usbredir_initfn(USBDevice *udev)
     }
 
     dev->chardev_close_bh = qemu_bh_new(usbredir_chardev_close_bh, dev);
+    dev->write_bh = qemu_bh_new(usbredir_write_bh, dev);
+    dev->write_buf = g_byte_array_new();
     dev->attach_timer = qemu_new_timer_ms(vm_clock, usbredir_do_attach, dev);
 
     packet_id_queue_init(&dev->cancelled, dev, "cancelled");
@@ -1326,6 +1426,7 @@ static void usbredir_cleanup_device_queues(USBRedirDevice *dev)
     packet_id_queue_empty(&dev->already_in_flight);
     for (i = 0; i < MAX_ENDPOINTS; i++) {
         usbredir_free_bufpq(dev, I2EP(i));
+        usbredir_free_bufp_pool(dev, I2EP(i));
     }
 }
 
@@ -1336,6 +1437,7 @@ static void usbredir_handle_destroy(USBDevice *udev)
     qemu_chr_delete(dev->cs);
     /* Note must be done after qemu_chr_close, as that causes a close event */
     qemu_bh_delete(dev->chardev_close_bh);
+    qemu_bh_delete(dev->write_bh);
 
     qemu_del_timer(dev->attach_timer);
     qemu_free_timer(dev->attach_timer);
@@ -1348,6 +1450,7 @@ static void usbredir_handle_destroy(USBDevice *udev)
     if (dev->watch) {
         g_source_remove(dev->watch);
     }
+    g_byte_array_free(dev->write_buf, TRUE);
 
     free(dev->filter_rules);
 }
@@ -2095,6 +2198,56 @@ static const VMStateInfo usbredir_parser_vmstate_info = {
 };
 
 
+/* For the gathered data the chardev didn't take yet */
+static void usbredir_put_write_buf(QEMUFile *f, void *priv, size_t unused)
+{
+    USBRedirDevice *dev = priv;
+
+    qemu_put_be32(f, dev->write_buf->len);
+    qemu_put_buffer(f, dev->write_buf->data, dev->write_buf->len);
+}
+
+static int usbredir_get_write_buf(QEMUFile *f, void *priv, size_t unused)
+{
+    USBRedirDevice *dev = priv;
+
+    g_byte_array_set_size(dev->write_buf, qemu_get_be32(f));
+    qemu_get_buffer(f, dev->write_buf->data, dev->write_buf->len);
+    return 0;
+}
+
+static const VMStateInfo usbredir_write_buf_vmstate_info = {
+    .name = "usb-redir-write-buf",
+    .put  = usbredir_put_write_buf,
+    .get  = usbredir_get_write_buf,
+};
+
+static const VMStateDescription usbredir_write_buf_vmstate = {
+    .name = "usb-redir/write-buf",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        {
+            .name         = "write_buf",
+            .version_id   = 0,
+            .field_exists = NULL,
+            .size         = 0,
+            .info         = &usbredir_write_buf_vmstate_info,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool usbredir_write_buf_needed(void *priv)
+{
+    USBRedirDevice *dev = priv;
+
+    return dev->write_buf->len != 0;
+}
+
+
 /* For buffered packets (iso/irq) queue migration */
 static void usbredir_put_bufpq(QEMUFile *f, void *priv, size_t unused)
 {
@@ -2335,6 +2488,14 @@ static const VMStateDescription usbredir_vmstate = {
                        usbredir_interface_info_vmstate,
                        struct usb_redir_interface_info_header),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &usbredir_write_buf_vmstate,
+            .needed = usbredir_write_buf_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -183,6 +183,39 @@ struct USBDescString {
 #define USB_MAX_ENDPOINTS  15
 #define USB_MAX_INTERFACES 16
 
+/*
+ * Latency histogram of completed packets: bucket 0 counts packets that took
+ * less than 1us, bucket i less than 2^i us, and the last one everything
+ * slower.
+ */
+#define USB_STATS_LATENCY_BUCKETS 16
+
+typedef struct USBEndpointStats {
+    uint64_t packets;       /* completed, successfully or not */
+    uint64_t bytes;
+    uint64_t async;         /* completed through usb_packet_complete() */
+    uint64_t naks;
+    uint64_t errors;
+    uint64_t latency[USB_STATS_LATENCY_BUCKETS];
+} USBEndpointStats;
+
+/*
+ * Packet trace, kept per bus in a ring of USB_TRACE_RING_SIZE records and
+ * dumped in Linux usbmon format by the usb-trace-dump QMP command.
+ */
+#define USB_TRACE_RING_SIZE 4096
+
+typedef struct USBTraceRecord {
+    uint64_t id;            /* pairs a submission with its completion */
+    int64_t ts;             /* get_clock() */
+    int32_t status;         /* Linux errno, as usbmon reports it */
+    uint32_t length;        /* requested on submission, actual on completion */
+    uint8_t type;           /* 'S'ubmission or 'C'ompletion */
+    uint8_t xfer_type;      /* USB_ENDPOINT_XFER_* */
+    uint8_t epnum;          /* endpoint number, USB_DIR_IN for in endpoints */
+    uint8_t devnum;
+} USBTraceRecord;
+
 struct USBEndpoint {
     uint8_t nr;
     uint8_t pid;
@@ -193,6 +226,7 @@ struct USBEndpoint {
     bool halted;
     USBDevice *dev;
     QTAILQ_HEAD(, USBPacket) queue;
+    USBEndpointStats stats;
 };
 
 enum USBDeviceFlags {
@@ -364,6 +398,7 @@ struct USBPacket {
     USBEndpoint *ep;
     unsigned int stream;
     QEMUIOVector iov;
+    QEMUSGList *sgl; /* guest RAM behind iov, if mapped without bouncing */
     uint64_t parameter; /* control transfers */
     bool short_not_ok;
     bool int_req;
@@ -371,6 +406,7 @@ struct USBPacket {
     int actual_length; /* Number of bytes actually transferred */
     /* Internal use by the USB layer.  */
     USBPacketState state;
+    int64_t submit_ns;
     USBCombinedPacket *combined;
     QTAILQ_ENTRY(USBPacket) queue;
     QTAILQ_ENTRY(USBPacket) combined_entry;
@@ -391,6 +427,8 @@ void usb_packet_setup(USBPacket *p, int pid,
 void usb_packet_addbuf(USBPacket *p, void *ptr, size_t len);
 int usb_packet_map(USBPacket *p, QEMUSGList *sgl);
 void usb_packet_unmap(USBPacket *p, QEMUSGList *sgl);
+int usb_packet_map_sglist(USBPacket *p, QEMUSGList *qsg,
+                          size_t offset, size_t len);
 void usb_packet_copy(USBPacket *p, void *ptr, size_t bytes);
 void usb_packet_skip(USBPacket *p, size_t bytes);
 size_t usb_packet_size(USBPacket *p);
@@ -487,6 +525,10 @@ struct USBBus {
     QTAILQ_HEAD(, USBPort) free;
     QTAILQ_HEAD(, USBPort) used;
     QTAILQ_ENTRY(USBBus) next;
+
+    /* Packet trace ring, see USBTraceRecord */
+    USBTraceRecord *trace;
+    uint64_t trace_count;   /* records written so far, wraps the ring */
 };
 
 struct USBBusOps {
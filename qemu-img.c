@@ -100,6 +100,8 @@ static void help(void)
            "  '-q' use Quiet mode - do not print any output (except errors)\n"
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
+           "  '-m' number of parallel coroutines for the convert process (default 8)\n"
+           "  '-W' allow to write to the output out of order during convert\n"
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "\n"
            "Parameters to check subcommand:\n"
@@ -1108,9 +1110,242 @@ out3:
     return ret;
 }
 
+/*
+ * Pipelined copy for img_convert: several coroutines each take the next
+ * chunk of the input, read it and write it out, so that multiple requests
+ * are in flight on both the source and the target.  Unless out of order
+ * writes are allowed, a coroutine waits for its turn before writing, which
+ * keeps the cluster allocation order of the output the same as with a
+ * sequential copy.
+ */
+#define MAX_CONVERT_COROUTINES 16
+#define DEFAULT_CONVERT_COROUTINES 8
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int src_num;
+    int64_t total_sectors;
+    int64_t sector_num;         /* next sector to hand out */
+    int64_t wr_offs;            /* next sector to write, if in order */
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool copy_allocated_only;   /* target has the same backing file */
+    bool wr_in_order;
+    int min_sparse;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_CONVERT_COROUTINES];
+    int64_t wait_sector_num[MAX_CONVERT_COROUTINES];
+    int ret;
+} ImgConvertState;
+
+/* Find the source image containing @sector_num and the offset into it */
+static BlockDriverState *convert_find_src(ImgConvertState *s,
+                                          int64_t sector_num,
+                                          int64_t *src_sector,
+                                          int64_t *src_remaining)
+{
+    uint64_t bs_sectors;
+    int i;
+
+    for (i = 0; i < s->src_num; i++) {
+        bdrv_get_geometry(s->src[i], &bs_sectors);
+        if (sector_num < bs_sectors) {
+            *src_sector = sector_num;
+            *src_remaining = bs_sectors - sector_num;
+            return s->src[i];
+        }
+        sector_num -= bs_sectors;
+    }
+    abort();
+}
+
+static void coroutine_fn convert_co_wait_turn(ImgConvertState *s, int index,
+                                              int64_t sector_num)
+{
+    while (s->wr_in_order && s->wr_offs != sector_num && !s->ret) {
+        s->wait_sector_num[index] = sector_num;
+        qemu_coroutine_yield();
+    }
+    s->wait_sector_num[index] = -1;
+}
+
+static void coroutine_fn convert_co_pass_turn(ImgConvertState *s,
+                                              int64_t sector_num)
+{
+    int i;
+
+    if (!s->wr_in_order) {
+        return;
+    }
+    s->wr_offs = sector_num;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == sector_num) {
+            qemu_coroutine_enter(s->co[i], NULL);
+            break;
+        }
+    }
+}
+
+static void coroutine_fn convert_co_fail(ImgConvertState *s, int ret)
+{
+    int i;
+
+    if (!s->ret) {
+        s->ret = ret;
+    }
+    /* Let everybody waiting for its turn give up */
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] != -1) {
+            qemu_coroutine_enter(s->co[i], NULL);
+        }
+    }
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, uint8_t *buf,
+                                         int n)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n1, ret;
+
+    while (n > 0) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        n1 = n;
+        if (!s->has_zero_init || s->copy_allocated_only ||
+            is_allocated_sectors_min(buf, n, &n1, s->min_sparse)) {
+            iov.iov_base = buf;
+            iov.iov_len = n1 * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_writev(s->target, sector_num, n1, &qiov);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                return ret;
+            }
+        }
+        sector_num += n1;
+        n -= n1;
+        buf += n1 * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    BlockDriverState *bs;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    uint8_t *buf;
+    int64_t sector_num, src_sector, src_remaining;
+    int index, n, n1, ret, allocated;
+
+    for (index = 0; index < s->num_coroutines; index++) {
+        if (s->co[index] == qemu_coroutine_self()) {
+            break;
+        }
+    }
+    assert(index < s->num_coroutines);
+
+    buf = qemu_blockalign(s->target, IO_BUF_SIZE);
+
+    while (!s->ret && s->sector_num < s->total_sectors) {
+        /* Take the next chunk, it never crosses a source image boundary */
+        sector_num = s->sector_num;
+        bs = convert_find_src(s, sector_num, &src_sector, &src_remaining);
+        n = MIN(s->total_sectors - sector_num, IO_BUF_SIZE / BDRV_SECTOR_SIZE);
+        n = MIN(n, src_remaining);
+        s->sector_num += n;
+
+        while (n > 0 && !s->ret) {
+            n1 = n;
+            allocated = 1;
+            if (s->copy_allocated_only) {
+                /* Sectors unallocated in the input image are present in
+                   both the output's and input's base images (no need to
+                   copy them). */
+                allocated = bdrv_co_is_allocated(bs, src_sector, n, &n1);
+                if (allocated < 0) {
+                    error_report("error while reading sector %" PRId64
+                                 ": %s", src_sector, strerror(-allocated));
+                    convert_co_fail(s, allocated);
+                    break;
+                }
+            }
+
+            if (allocated) {
+                iov.iov_base = buf;
+                iov.iov_len = n1 * BDRV_SECTOR_SIZE;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+                ret = bdrv_co_readv(bs, src_sector, n1, &qiov);
+                if (ret < 0) {
+                    error_report("error while reading sector %" PRId64
+                                 ": %s", src_sector, strerror(-ret));
+                    convert_co_fail(s, ret);
+                    break;
+                }
+            }
+
+            convert_co_wait_turn(s, index, sector_num);
+            if (s->ret) {
+                break;
+            }
+            if (allocated) {
+                ret = convert_co_write(s, sector_num, buf, n1);
+                if (ret < 0) {
+                    convert_co_fail(s, ret);
+                    break;
+                }
+            }
+            sector_num += n1;
+            src_sector += n1;
+            n -= n1;
+            convert_co_pass_turn(s, sector_num);
+            qemu_progress_print(100.0f * n1 / s->total_sectors, 100);
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int i;
+
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->ret = 0;
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+    s->running_coroutines = s->num_coroutines;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], s);
+        }
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, n, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int batch_sectors;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
@@ -1118,7 +1353,6 @@ static int img_convert(int argc, char **argv)
     int64_t total_sectors, nb_sectors, sector_num, bs_offset;
     uint64_t bs_sectors;
     uint8_t * buf = NULL;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
@@ -1127,6 +1361,9 @@ static int img_convert(int argc, char **argv)
     float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
     bool quiet = false;
+    int num_coroutines = DEFAULT_CONVERT_COROUTINES;
+    bool wr_in_order = true;
+    ImgConvertState state;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1134,7 +1371,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:q");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qm:W");
         if (c == -1) {
             break;
         }
@@ -1191,6 +1428,22 @@ static int img_convert(int argc, char **argv)
         case 'q':
             quiet = true;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_CONVERT_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_CONVERT_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1370,26 +1623,25 @@ static int img_convert(int argc, char **argv)
             goto out;
         }
         cluster_sectors = cluster_size >> 9;
+        /* read as many whole clusters as fit in the buffer at once */
+        batch_sectors = (IO_BUF_SIZE / cluster_size) * cluster_sectors;
         sector_num = 0;
 
         nb_sectors = total_sectors;
         if (nb_sectors != 0) {
             local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, cluster_sectors));
+                (nb_sectors / MIN(nb_sectors, batch_sectors));
         }
 
         for(;;) {
             int64_t bs_num;
-            int remainder;
+            int remainder, i, run;
             uint8_t *buf2;
 
             nb_sectors = total_sectors - sector_num;
             if (nb_sectors <= 0)
                 break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
+            n = MIN(nb_sectors, batch_sectors);
 
             bs_num = sector_num - bs_offset;
             assert (bs_num >= 0);
@@ -1425,11 +1677,29 @@ static int img_convert(int argc, char **argv)
             }
             assert (remainder == 0);
 
-            if (!buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf, n);
+            /* Zero clusters are skipped; runs of non-zero clusters are
+               passed down together so that the driver can compress them
+               in parallel */
+            for (i = 0; i < n; i += run) {
+                run = MIN(cluster_sectors, n - i);
+                if (buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                                   run * BDRV_SECTOR_SIZE)) {
+                    continue;
+                }
+                while (i + run < n) {
+                    int len = MIN(cluster_sectors, n - i - run);
+                    if (buffer_is_zero(buf + (i + run) * BDRV_SECTOR_SIZE,
+                                       len * BDRV_SECTOR_SIZE)) {
+                        break;
+                    }
+                    run += len;
+                }
+
+                ret = bdrv_write_compressed(out_bs, sector_num + i,
+                                            buf + i * BDRV_SECTOR_SIZE, run);
                 if (ret != 0) {
                     error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
+                                 ": %s", sector_num + i, strerror(-ret));
                     goto out;
                 }
             }
@@ -1439,92 +1709,18 @@ static int img_convert(int argc, char **argv)
         /* signal EOF to align */
         bdrv_write_compressed(out_bs, 0, NULL, 0);
     } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-        }
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
+        memset(&state, 0, sizeof(state));
+        state.src = bs;
+        state.src_num = bs_n;
+        state.total_sectors = total_sectors;
+        state.target = out_bs;
+        state.has_zero_init = bdrv_has_zero_init(out_bs);
+        state.copy_allocated_only = state.has_zero_init && out_baseimg;
+        state.wr_in_order = wr_in_order;
+        state.min_sparse = min_sparse;
+        state.num_coroutines = num_coroutines;
+
+        ret = convert_do_copy(&state);
     }
 out:
     qemu_progress_end();
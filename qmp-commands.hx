@@ -2931,4 +2931,65 @@ Example:
 -> { "execute": "chardev-remove", "arguments": { "id" : "foo" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "query-usb-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_usb_stats,
+    },
+
+SQMP
+query-usb-stats
+---------------
+
+Return per-endpoint transfer statistics of all attached USB devices.  Only
+endpoints that have seen traffic are listed.  The latency histogram counts
+completed packets by the time from submission to completion, in power of
+two microsecond buckets; empty buckets are omitted.
+
+Arguments: None
+
+Example:
+
+-> { "execute": "query-usb-stats" }
+<- { "return": [
+       { "bus": 0, "port": "1", "addr": 2, "product": "QEMU USB Avrkrypt",
+         "id": "usb-avrk0",
+         "endpoints": [
+           { "nr": 0, "direction": "control", "packets": 312, "bytes": 1156,
+             "async": 0, "naks": 0, "errors": 0,
+             "latency": [ { "below-us": 4, "count": 280 },
+                          { "below-us": 8, "count": 32 } ] },
+           { "nr": 2, "direction": "out", "packets": 64, "bytes": 1048576,
+             "async": 64, "naks": 3, "errors": 0,
+             "latency": [ { "below-us": 1024, "count": 64 } ] } ] } ] }
+
+EQMP
+
+    {
+        .name       = "usb-trace-dump",
+        .args_type  = "filename:s,bus:i?",
+        .mhandler.cmd_new = qmp_marshal_input_usb_trace_dump,
+    },
+
+SQMP
+usb-trace-dump
+--------------
+
+Write the recent USB packet trace to a file in pcap format (Linux usbmon
+link type).  Every bus records its last 4096 packet submissions and
+completions with endpoint, length, status and timestamp, but no data.
+
+Arguments:
+
+- "filename": the file to write the capture to (json-string)
+- "bus": only dump this USB bus, all by default (json-int, optional)
+
+Example:
+
+-> { "execute": "usb-trace-dump",
+     "arguments": { "filename": "/tmp/usb.pcap", "bus": 0 } }
+<- { "return": {} }
+
 EQMP
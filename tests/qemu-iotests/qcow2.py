@@ -181,7 +181,7 @@ def cmd_del_header_ext(fd, magic):
 
     h.update(fd)
 
-def cmd_set_feature_bit(fd, group, bit):
+def change_feature_bit(fd, group, bit, value):
     try:
         bit = int(bit, 0)
         if bit < 0 or bit >= 64:
@@ -192,22 +192,32 @@ def cmd_set_feature_bit(fd, group, bit):
 
     h = QcowHeader(fd)
     if group == 'incompatible':
-        h.incompatible_features |= 1 << bit
+        h.incompatible_features &= ~(1 << bit)
+        h.incompatible_features |= value << bit
     elif group == 'compatible':
-        h.compatible_features |= 1 << bit
+        h.compatible_features &= ~(1 << bit)
+        h.compatible_features |= value << bit
     elif group == 'autoclear':
-        h.autoclear_features |= 1 << bit
+        h.autoclear_features &= ~(1 << bit)
+        h.autoclear_features |= value << bit
     else:
         print "'%s' is not a valid group, try 'incompatible', 'compatible', or 'autoclear'" % group
         sys.exit(1)
 
     h.update(fd)
 
+def cmd_set_feature_bit(fd, group, bit):
+    change_feature_bit(fd, group, bit, 1)
+
+def cmd_clear_feature_bit(fd, group, bit):
+    change_feature_bit(fd, group, bit, 0)
+
 cmds = [
     [ 'dump-header',    cmd_dump_header,    0, 'Dump image header and header extensions' ],
     [ 'add-header-ext', cmd_add_header_ext, 2, 'Add a header extension' ],
     [ 'del-header-ext', cmd_del_header_ext, 1, 'Delete a header extension' ],
     [ 'set-feature-bit', cmd_set_feature_bit, 2, 'Set a feature bit'],
+    [ 'clear-feature-bit', cmd_clear_feature_bit, 2, 'Clear a feature bit'],
 ]
 
 def main(filename, cmd, args):
@@ -0,0 +1,216 @@
+/*
+ * usb-avrk AES128 backend unit tests
+ *
+ * Copyright (c) 2014 Hao Fei.
+ *
+ * This code is licensed under the LGPL.
+ */
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "aes.h"
+
+#define MAX_BLOCKS 37
+
+/* NIST SP 800-38A, appendix F: AES-128 with a shared key and plaintext */
+static const uint8_t nist_key[16] = {
+    0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+    0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+};
+
+static const uint8_t nist_plain[64] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+    0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+    0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+    0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+    0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+    0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+    0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+};
+
+static const uint8_t nist_ecb[64] = {
+    0x3a, 0xd7, 0x7b, 0xb4, 0x0d, 0x7a, 0x36, 0x60,
+    0xa8, 0x9e, 0xca, 0xf3, 0x24, 0x66, 0xef, 0x97,
+    0xf5, 0xd3, 0xd5, 0x85, 0x03, 0xb9, 0x69, 0x9d,
+    0xe7, 0x85, 0x89, 0x5a, 0x96, 0xfd, 0xba, 0xaf,
+    0x43, 0xb1, 0xcd, 0x7f, 0x59, 0x8e, 0xce, 0x23,
+    0x88, 0x1b, 0x00, 0xe3, 0xed, 0x03, 0x06, 0x88,
+    0x7b, 0x0c, 0x78, 0x5e, 0x27, 0xe8, 0xad, 0x3f,
+    0x82, 0x23, 0x20, 0x71, 0x04, 0x72, 0x5d, 0xd4,
+};
+
+static const uint8_t nist_cbc_iv[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+};
+
+static const uint8_t nist_cbc[64] = {
+    0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46,
+    0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+    0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee,
+    0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+    0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b,
+    0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+    0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09,
+    0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7,
+};
+
+static const uint8_t nist_ctr_iv[16] = {
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+    0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff,
+};
+
+static const uint8_t nist_ctr[64] = {
+    0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26,
+    0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+    0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff,
+    0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff,
+    0x5a, 0xe4, 0xdf, 0x3e, 0xdb, 0xd5, 0xd3, 0x5e,
+    0x5b, 0x4f, 0x09, 0x02, 0x0d, 0xb0, 0x3e, 0xab,
+    0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03, 0xd1,
+    0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c, 0xee,
+};
+
+static void test_nist(gconstpointer opaque)
+{
+    const AES128_backend *b = opaque;
+    AES128_ctx ctx;
+    uint8_t buf[64], iv[16];
+
+    AES128_init_ctx(&ctx, nist_key);
+
+    b->ecb_encrypt(&ctx, nist_plain, buf, 4);
+    g_assert(memcmp(buf, nist_ecb, 64) == 0);
+    b->ecb_decrypt(&ctx, buf, buf, 4);
+    g_assert(memcmp(buf, nist_plain, 64) == 0);
+
+    memcpy(iv, nist_cbc_iv, 16);
+    b->cbc_encrypt(&ctx, iv, nist_plain, buf, 4);
+    g_assert(memcmp(buf, nist_cbc, 64) == 0);
+    g_assert(memcmp(iv, nist_cbc + 48, 16) == 0);
+    memcpy(iv, nist_cbc_iv, 16);
+    b->cbc_decrypt(&ctx, iv, buf, buf, 4);
+    g_assert(memcmp(buf, nist_plain, 64) == 0);
+
+    memcpy(iv, nist_ctr_iv, 16);
+    b->ctr_crypt(&ctx, iv, nist_plain, buf, 4);
+    g_assert(memcmp(buf, nist_ctr, 64) == 0);
+    memcpy(iv, nist_ctr_iv, 16);
+    b->ctr_crypt(&ctx, iv, buf, buf, 4);
+    g_assert(memcmp(buf, nist_plain, 64) == 0);
+}
+
+/* IEEE 1619-2007, XTS-AES-128 vector 2 */
+static void test_xts(void)
+{
+    uint8_t key1[16], key2[16], unit[16], tweak[16], buf[32];
+    static const uint8_t xts_cipher[32] = {
+        0xc4, 0x54, 0x18, 0x5e, 0x6a, 0x16, 0x93, 0x6e,
+        0x39, 0x33, 0x40, 0x38, 0xac, 0xef, 0x83, 0x8b,
+        0xfb, 0x18, 0x6f, 0xff, 0x74, 0x80, 0xad, 0xc4,
+        0x28, 0x93, 0x82, 0xec, 0xd6, 0xd3, 0x94, 0xf0,
+    };
+    AES128_ctx ctx, tweak_ctx;
+
+    memset(key1, 0x11, 16);
+    memset(key2, 0x22, 16);
+    memset(unit, 0, 16);
+    memset(unit, 0x33, 5);
+    memset(buf, 0x44, 32);
+    AES128_init_ctx(&ctx, key1);
+    AES128_init_ctx(&tweak_ctx, key2);
+
+    AES128_ECB_encrypt_ctx(&tweak_ctx, unit, tweak);
+    AES128_XTS_encrypt_blocks(&ctx, tweak, buf, buf, 2);
+    g_assert(memcmp(buf, xts_cipher, 32) == 0);
+
+    AES128_ECB_encrypt_ctx(&tweak_ctx, unit, tweak);
+    AES128_XTS_decrypt_blocks(&ctx, tweak, buf, buf, 2);
+    g_assert(buf[0] == 0x44 && memcmp(buf, buf + 1, 31) == 0);
+}
+
+#ifdef CONFIG_AES_NI
+static void fill_random(uint8_t *buf, size_t len)
+{
+    while (len--) {
+        *buf++ = g_test_rand_int();
+    }
+}
+
+/* every mode must be bit-exact with the portable reference backend */
+static void test_vs_soft(gconstpointer opaque)
+{
+    const AES128_backend *b = opaque;
+    const AES128_backend *ref = &AES128_backend_soft;
+    uint8_t key[16], iv[16], iv_ref[16];
+    uint8_t in[MAX_BLOCKS * 16], out[MAX_BLOCKS * 16];
+    uint8_t out_ref[MAX_BLOCKS * 16];
+    AES128_ctx ctx;
+    size_t blocks;
+
+    for (blocks = 1; blocks <= MAX_BLOCKS; blocks++) {
+        fill_random(key, sizeof(key));
+        fill_random(iv, sizeof(iv));
+        fill_random(in, blocks * 16);
+        AES128_init_ctx(&ctx, key);
+
+        b->ecb_encrypt(&ctx, in, out, blocks);
+        ref->ecb_encrypt(&ctx, in, out_ref, blocks);
+        g_assert(memcmp(out, out_ref, blocks * 16) == 0);
+
+        b->ecb_decrypt(&ctx, in, out, blocks);
+        ref->ecb_decrypt(&ctx, in, out_ref, blocks);
+        g_assert(memcmp(out, out_ref, blocks * 16) == 0);
+
+        memcpy(iv_ref, iv, 16);
+        b->cbc_encrypt(&ctx, iv, in, out, blocks);
+        ref->cbc_encrypt(&ctx, iv_ref, in, out_ref, blocks);
+        g_assert(memcmp(out, out_ref, blocks * 16) == 0);
+        g_assert(memcmp(iv, iv_ref, 16) == 0);
+
+        b->cbc_decrypt(&ctx, iv, in, out, blocks);
+        ref->cbc_decrypt(&ctx, iv_ref, in, out_ref, blocks);
+        g_assert(memcmp(out, out_ref, blocks * 16) == 0);
+        g_assert(memcmp(iv, iv_ref, 16) == 0);
+
+        /* make the low counter word wrap somewhere inside the run */
+        memset(iv + 8, 0xff, 8);
+        iv[15] -= blocks / 2;
+        memcpy(iv_ref, iv, 16);
+        b->ctr_crypt(&ctx, iv, in, out, blocks);
+        ref->ctr_crypt(&ctx, iv_ref, in, out_ref, blocks);
+        g_assert(memcmp(out, out_ref, blocks * 16) == 0);
+        g_assert(memcmp(iv, iv_ref, 16) == 0);
+    }
+}
+#endif
+
+static void test_compat(void)
+{
+    uint8_t buf[16];
+
+    AES128_ECB_encrypt((uint8_t *)nist_plain, (uint8_t *)nist_key, buf);
+    g_assert(memcmp(buf, nist_ecb, 16) == 0);
+    AES128_ECB_decrypt(buf, (uint8_t *)nist_key, buf);
+    g_assert(memcmp(buf, nist_plain, 16) == 0);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_data_func("/avrk-aes/soft/nist", &AES128_backend_soft,
+                         test_nist);
+#ifdef CONFIG_AES_NI
+    if (AES128_aesni_available()) {
+        g_test_add_data_func("/avrk-aes/aesni/nist", &AES128_backend_aesni,
+                             test_nist);
+        g_test_add_data_func("/avrk-aes/aesni/vs-soft", &AES128_backend_aesni,
+                             test_vs_soft);
+    }
+#endif
+    g_test_add_func("/avrk-aes/xts", test_xts);
+    g_test_add_func("/avrk-aes/compat", test_compat);
+
+    return g_test_run();
+}
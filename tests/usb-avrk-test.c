@@ -0,0 +1,1001 @@
+/*
+ * QTest testcase and benchmark for the usb-avrk crypto stick
+ *
+ * Copyright (c) 2014 Hao Fei.
+ *
+ * This code is licensed under the LGPL.
+ *
+ * Most tests run twice.  First the stick is attached to the PIIX3 UHCI
+ * controller, driven with a single queue head hanging off every frame
+ * list entry, where it runs at full speed.  Then it is attached to an
+ * EHCI controller, driven with one queue head per endpoint on the async
+ * schedule, where it runs at high speed with its high-speed descriptors.
+ * Transfers complete as the frame timer runs, so each one is stepped
+ * through vm_clock a frame at a time.
+ *
+ * The offload tests only run on EHCI, whose transfer descriptors carry
+ * packets large enough for the thread pool.  They compare its output with
+ * the inline path's.
+ *
+ * xHCI is not covered.  It needs command and event rings and device slot
+ * and endpoint contexts before the first transfer.  The stick has no
+ * SuperSpeed descriptors either, so xHCI would only repeat the high-speed
+ * run.
+ *
+ * Running with "-m perf" adds benchmarks of the control and bulk
+ * protocols, which report throughput, per control transfer latency
+ * percentiles and, on x86 hosts, TSC cycles per byte.  As qtest runs in
+ * lock step with QEMU these measure wall time spent by both processes.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+#include "qemu-common.h"
+
+#define UHCI_PCI_DEV    1
+#define UHCI_PCI_FUNC   2
+
+enum {
+    UHCI_USBCMD     = 0x00,
+    UHCI_FRNUM      = 0x06,
+    UHCI_FLBASEADD  = 0x08,
+    UHCI_PORTSC1    = 0x10,
+};
+
+#define UHCI_CMD_RS         (1 << 0)
+#define UHCI_PORT_EN        (1 << 2)
+#define UHCI_PORT_RESET     (1 << 9)
+
+#define UHCI_LINK_TERM      (1 << 0)
+#define UHCI_LINK_QH        (1 << 1)
+#define UHCI_LINK_DEPTH     (1 << 2)
+
+#define TD_CTRL_ACTIVE      (1 << 23)
+#define TD_CTRL_STALL       (1 << 22)
+#define TD_CTRL_ERROR_SHIFT 27
+
+#define EHCI_PCI_DEV    4
+
+enum {
+    EHCI_CAPLENGTH      = 0x00,
+};
+
+/* operational registers, at CAPLENGTH */
+enum {
+    EHCI_USBCMD         = 0x00,
+    EHCI_ASYNCLISTADDR  = 0x18,
+    EHCI_CONFIGFLAG     = 0x40,
+    EHCI_PORTSC1        = 0x44,
+};
+
+#define EHCI_CMD_RS         (1 << 0)
+#define EHCI_CMD_ASE        (1 << 5)
+#define EHCI_PORT_RESET     (1 << 8)
+#define EHCI_PORT_POWER     (1 << 12)
+
+#define EHCI_LINK_TERM      (1 << 0)
+#define EHCI_LINK_QH        (1 << 1)
+
+/* queue head: link, characteristics, capabilities, overlay */
+enum {
+    QH_EPCHAR           = 0x04,
+    QH_EPCAP            = 0x08,
+    QH_NEXT_QTD         = 0x10,
+    QH_ALTNEXT_QTD      = 0x14,
+    QH_TOKEN            = 0x18,
+    QH_SIZE             = 0x40,
+};
+
+#define QH_EPCHAR_MPLEN_SHIFT 16
+#define QH_EPCHAR_H         (1 << 15)
+#define QH_EPCHAR_DTC       (1 << 14)
+#define QH_EPCHAR_EPS_HIGH  (2 << 12)
+#define QH_EPCHAR_EP_SHIFT  8
+#define QH_EPCAP_MULT_1     (1 << 30)
+
+/* queue element transfer descriptor */
+enum {
+    QTD_NEXT            = 0x00,
+    QTD_ALTNEXT         = 0x04,
+    QTD_TOKEN           = 0x08,
+    QTD_BUFPTR0         = 0x0c,
+    QTD_SIZE            = 0x20,
+};
+
+#define QTD_BUFPTRS         5
+
+#define QTD_TOKEN_DTOGGLE   (1u << 31)
+#define QTD_TOKEN_TBYTES_SHIFT 16
+#define QTD_TOKEN_CERR_3    (3 << 10)
+#define QTD_TOKEN_PID_SHIFT 8
+#define QTD_TOKEN_ACTIVE    (1 << 7)
+#define QTD_TOKEN_HALT      (1 << 6)
+
+#define PID_OUT     0xe1
+#define PID_IN      0x69
+#define PID_SETUP   0x2d
+
+#define FRAME_NS    1000000
+#define MAX_FRAMES  1000
+
+/* guest memory layout, one page each but for the data buffer */
+#define MAX_TDS     64
+#define DATA_SIZE   16384
+
+#define AVRK_EP_IN  1
+#define AVRK_EP_OUT 2
+
+#define VENDOR_OUT  0x40
+#define VENDOR_IN   0xc0
+
+/*
+ * Offload packets above 8 KiB in four slices.  Bulk packets of bulk_maxp
+ * bytes stay below the threshold and take the inline path.
+ */
+#define OFFLOAD_OPTS        ",offload-threshold=8192,offload-jobs=4"
+#define OFFLOAD_PACKET      DATA_SIZE
+#define OFFLOAD_BYTES       (2 * OFFLOAD_PACKET)
+
+enum {
+    REQ_STATUS          = 1,
+    REQ_UPLOAD_A        = 4,
+    REQ_DOWNLOAD_A      = 8,
+    REQ_START_ENCRYPT   = 10,
+    REQ_CHANGE_KEY      = 12,
+    REQ_STREAM_RESET    = 13,
+    REQ_STREAM_FLUSH    = 14,
+    REQ_SET_MODE        = 16,
+    REQ_SET_IV          = 17,
+};
+
+#define AVRK_MODE_CBC       1
+#define AVRK_MODE_CTR       2
+#define AVRK_MODE_XTS       3
+#define AVRK_MODE_DECRYPT   0x100
+#define AVRK_KEYSLOTS 8
+
+#define BENCH_BLOCKS        1000
+#define BENCH_STREAM_BYTES  (64 * 1024)
+
+/* a host controller, and how the stick looks behind it */
+typedef struct {
+    const char *name;
+    const char *args;       /* QEMU arguments adding the controller */
+    const char *bus;        /* usb-avrk bus property */
+    int devfn;
+    int bar;
+    int ctrl_maxp;
+    int bulk_maxp;
+    uint16_t bcd_usb;
+    void (*start)(void);
+    /* set up transfer descriptor @i */
+    void (*write_td)(int i, int pid, int ep, int toggle, uint64_t buf,
+                     int len);
+    /* run descriptors 0..@n-1 on endpoint @ep; false on a stall */
+    bool (*run)(int ep, int n);
+} AvrkHost;
+
+typedef struct {
+    const AvrkHost *host;
+    QPCIBus *pcibus;
+    QPCIDevice *dev;
+    void *base;
+    void *op;               /* EHCI operational registers */
+    uint64_t frame_list;
+    uint64_t qh;
+    uint64_t tds;
+    uint64_t data;
+    uint64_t ctrl;          /* control transfers queued next to bulk ones */
+    uint8_t toggle[16];
+    char *state_path;
+} AvrkTest;
+
+static AvrkTest t;
+
+/* NIST SP 800-38A, appendix F: AES-128 */
+static const uint8_t nist_key[16] = {
+    0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+    0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+};
+
+static const uint8_t nist_plain[64] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+    0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+    0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+    0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+    0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+    0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+    0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+};
+
+static const uint8_t nist_ecb[64] = {
+    0x3a, 0xd7, 0x7b, 0xb4, 0x0d, 0x7a, 0x36, 0x60,
+    0xa8, 0x9e, 0xca, 0xf3, 0x24, 0x66, 0xef, 0x97,
+    0xf5, 0xd3, 0xd5, 0x85, 0x03, 0xb9, 0x69, 0x9d,
+    0xe7, 0x85, 0x89, 0x5a, 0x96, 0xfd, 0xba, 0xaf,
+    0x43, 0xb1, 0xcd, 0x7f, 0x59, 0x8e, 0xce, 0x23,
+    0x88, 0x1b, 0x00, 0xe3, 0xed, 0x03, 0x06, 0x88,
+    0x7b, 0x0c, 0x78, 0x5e, 0x27, 0xe8, 0xad, 0x3f,
+    0x82, 0x23, 0x20, 0x71, 0x04, 0x72, 0x5d, 0xd4,
+};
+
+static const uint8_t nist_cbc_iv[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+};
+
+static const uint8_t nist_cbc[64] = {
+    0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46,
+    0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+    0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee,
+    0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+    0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b,
+    0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+    0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09,
+    0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7,
+};
+
+static int64_t get_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t get_cycles(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    uint32_t lo, hi;
+
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+static uint64_t uhci_td(int i)
+{
+    return t.tds + 16 * i;
+}
+
+static uint32_t uhci_token(int pid, int ep, int toggle, int len)
+{
+    return (((len - 1) & 0x7ff) << 21) | (toggle << 19) | (ep << 15) | pid;
+}
+
+static void uhci_write_td(int i, int pid, int ep, int toggle, uint64_t buf,
+                          int len)
+{
+    uint64_t td = uhci_td(i);
+
+    writel(td + 4, TD_CTRL_ACTIVE | (3 << TD_CTRL_ERROR_SHIFT));
+    writel(td + 8, uhci_token(pid, ep, toggle, len));
+    writel(td + 12, buf);
+}
+
+/* queue TDs 0..@n-1 and run frames until they complete; false on a stall */
+static bool uhci_run(int ep, int n)
+{
+    uint32_t el, ctrl;
+    int i;
+
+    for (i = 0; i < n - 1; i++) {
+        writel(uhci_td(i), uhci_td(i + 1) | UHCI_LINK_DEPTH);
+    }
+    writel(uhci_td(n - 1), UHCI_LINK_TERM);
+    writel(t.qh + 4, uhci_td(0));
+
+    for (i = 0; i < MAX_FRAMES; i++) {
+        clock_step(FRAME_NS);
+        el = readl(t.qh + 4);
+        if (el & UHCI_LINK_TERM) {
+            return true;
+        }
+        ctrl = readl((el & ~0xf) + 4);
+        if (!(ctrl & TD_CTRL_ACTIVE)) {
+            g_assert(ctrl & TD_CTRL_STALL);
+            writel(t.qh + 4, UHCI_LINK_TERM);
+            return false;
+        }
+    }
+    g_assert_not_reached();
+}
+
+static void uhci_start(void)
+{
+    int i;
+
+    writel(t.qh, UHCI_LINK_TERM);
+    writel(t.qh + 4, UHCI_LINK_TERM);
+    for (i = 0; i < 1024; i++) {
+        writel(t.frame_list + 4 * i, t.qh | UHCI_LINK_QH);
+    }
+
+    qpci_io_writel(t.dev, t.base + UHCI_FLBASEADD, t.frame_list);
+    qpci_io_writew(t.dev, t.base + UHCI_FRNUM, 0);
+    qpci_io_writew(t.dev, t.base + UHCI_PORTSC1, UHCI_PORT_RESET);
+    qpci_io_writew(t.dev, t.base + UHCI_PORTSC1, 0);
+    qpci_io_writew(t.dev, t.base + UHCI_PORTSC1, UHCI_PORT_EN);
+    qpci_io_writew(t.dev, t.base + UHCI_USBCMD, UHCI_CMD_RS);
+}
+
+/*
+ * One queue head per endpoint.  The bulk OUT one is the head of the list,
+ * so that within a frame a bulk OUT packet is always submitted before a
+ * control transfer queued at the same time.
+ */
+static uint64_t ehci_qh(int ep)
+{
+    return t.qh + QH_SIZE * ep;
+}
+
+static uint64_t ehci_qtd(int i)
+{
+    return t.tds + QTD_SIZE * i;
+}
+
+static void ehci_write_td(int i, int pid, int ep, int toggle, uint64_t buf,
+                          int len)
+{
+    uint64_t qtd = ehci_qtd(i);
+    int code = pid == PID_OUT ? 0 : pid == PID_IN ? 1 : 2;
+
+    int p;
+
+    writel(qtd + QTD_ALTNEXT, EHCI_LINK_TERM);
+    writel(qtd + QTD_BUFPTR0, buf);
+    for (p = 1; p < QTD_BUFPTRS; p++) {
+        writel(qtd + QTD_BUFPTR0 + 4 * p, (buf & ~0xfffULL) + 0x1000 * p);
+    }
+    writel(qtd + QTD_TOKEN, (toggle ? QTD_TOKEN_DTOGGLE : 0) |
+                            (len << QTD_TOKEN_TBYTES_SHIFT) |
+                            QTD_TOKEN_CERR_3 |
+                            (code << QTD_TOKEN_PID_SHIFT) |
+                            QTD_TOKEN_ACTIVE);
+}
+
+/* hang qTDs @first..@first+@n-1 off the queue head of @ep */
+static void ehci_queue(int ep, int first, int n)
+{
+    uint64_t qh = ehci_qh(ep);
+    int i;
+
+    for (i = first; i < first + n - 1; i++) {
+        writel(ehci_qtd(i) + QTD_NEXT, ehci_qtd(i + 1));
+    }
+    writel(ehci_qtd(first + n - 1) + QTD_NEXT, EHCI_LINK_TERM);
+    writel(qh + QH_TOKEN, 0);
+    writel(qh + QH_NEXT_QTD, ehci_qtd(first));
+}
+
+/* run frames until qTDs @first..@first+@n-1 are done; false on a stall */
+static bool ehci_wait(int ep, int first, int n)
+{
+    uint64_t qh = ehci_qh(ep);
+    uint32_t token;
+    int i, j;
+
+    for (i = 0; i < MAX_FRAMES; i++) {
+        for (j = first; j < first + n; j++) {
+            token = readl(ehci_qtd(j) + QTD_TOKEN);
+            if (token & QTD_TOKEN_HALT) {
+                /* clear the halted overlay for the next transfer */
+                writel(qh + QH_TOKEN, 0);
+                writel(qh + QH_NEXT_QTD, EHCI_LINK_TERM);
+                return false;
+            }
+            if (token & QTD_TOKEN_ACTIVE) {
+                break;
+            }
+        }
+        if (j == first + n) {
+            return true;
+        }
+        clock_step(FRAME_NS);
+    }
+    g_assert_not_reached();
+}
+
+static bool ehci_run(int ep, int n)
+{
+    ehci_queue(ep, 0, n);
+    return ehci_wait(ep, 0, n);
+}
+
+static void ehci_start(void)
+{
+    uint64_t qh;
+    int ep, maxp;
+
+    t.op = t.base + qpci_io_readb(t.dev, t.base + EHCI_CAPLENGTH);
+
+    /* the host decides on the toggles, as the UHCI run does */
+    for (ep = 0; ep <= AVRK_EP_OUT; ep++) {
+        qh = ehci_qh(ep);
+        maxp = ep ? t.host->bulk_maxp : t.host->ctrl_maxp;
+        writel(qh, ehci_qh((ep + 1) % (AVRK_EP_OUT + 1)) | EHCI_LINK_QH);
+        writel(qh + QH_EPCHAR, (maxp << QH_EPCHAR_MPLEN_SHIFT) |
+                               (ep == AVRK_EP_OUT ? QH_EPCHAR_H : 0) |
+                               QH_EPCHAR_DTC |
+                               QH_EPCHAR_EPS_HIGH |
+                               (ep << QH_EPCHAR_EP_SHIFT));
+        writel(qh + QH_EPCAP, QH_EPCAP_MULT_1);
+        writel(qh + QH_NEXT_QTD, EHCI_LINK_TERM);
+        writel(qh + QH_ALTNEXT_QTD, EHCI_LINK_TERM);
+        writel(qh + QH_TOKEN, 0);
+    }
+
+    qpci_io_writel(t.dev, t.op + EHCI_ASYNCLISTADDR, ehci_qh(AVRK_EP_OUT));
+    qpci_io_writel(t.dev, t.op + EHCI_CONFIGFLAG, 1);
+    /* the port comes out of reset enabled, as the stick is high speed */
+    qpci_io_writel(t.dev, t.op + EHCI_PORTSC1,
+                   EHCI_PORT_POWER | EHCI_PORT_RESET);
+    qpci_io_writel(t.dev, t.op + EHCI_PORTSC1, EHCI_PORT_POWER);
+    qpci_io_writel(t.dev, t.op + EHCI_USBCMD, EHCI_CMD_RS | EHCI_CMD_ASE);
+}
+
+static bool avrk_control(uint8_t type, uint8_t request, uint16_t value,
+                         uint16_t index, uint16_t length, void *data)
+{
+    uint8_t setup[8] = {
+        type, request, value & 0xff, value >> 8,
+        index & 0xff, index >> 8, length & 0xff, length >> 8,
+    };
+    int in = type & 0x80;
+    int n = 0, off, len;
+    bool ret;
+
+    memwrite(t.data, setup, sizeof(setup));
+    t.host->write_td(n++, PID_SETUP, 0, 0, t.data, 8);
+
+    if (!in && length) {
+        memwrite(t.data + 8, data, length);
+    }
+    for (off = 0; off < length; off += t.host->ctrl_maxp) {
+        len = MIN(length - off, t.host->ctrl_maxp);
+        /* the data stage starts with DATA1 */
+        t.host->write_td(n, in ? PID_IN : PID_OUT, 0, n & 1,
+                         t.data + 8 + off, len);
+        n++;
+    }
+    /* the status stage goes the other way, IN if there was no data */
+    t.host->write_td(n++, in && length ? PID_OUT : PID_IN, 0, 1, 0, 0);
+
+    ret = t.host->run(0, n);
+    if (ret && in && length) {
+        memread(t.data + 8, data, length);
+    }
+    return ret;
+}
+
+/* transfer @size bytes in packets of at most @packet bytes */
+static void avrk_bulk_packets(int ep, int pid, uint8_t *buf, size_t size,
+                              int packet)
+{
+    size_t done, chunk;
+    int n, len, off;
+
+    for (done = 0; done < size; done += chunk) {
+        chunk = MIN(size - done, DATA_SIZE);
+        chunk = MIN(chunk, MAX_TDS * packet);
+        if (pid == PID_OUT) {
+            memwrite(t.data, buf + done, chunk);
+        }
+        for (n = 0, off = 0; off < chunk; off += len, n++) {
+            len = MIN(chunk - off, packet);
+            t.host->write_td(n, pid, ep, t.toggle[ep], t.data + off, len);
+            t.toggle[ep] ^= DIV_ROUND_UP(len, t.host->bulk_maxp) & 1;
+        }
+        g_assert(t.host->run(ep, n));
+        if (pid == PID_IN) {
+            memread(t.data, buf + done, chunk);
+        }
+    }
+}
+
+static void avrk_bulk(int ep, int pid, uint8_t *buf, size_t size)
+{
+    avrk_bulk_packets(ep, pid, buf, size, t.host->bulk_maxp);
+}
+
+static void avrk_bulk_out(uint8_t *buf, size_t size)
+{
+    avrk_bulk(AVRK_EP_OUT, PID_OUT, buf, size);
+}
+
+static void avrk_bulk_in(uint8_t *buf, size_t size)
+{
+    avrk_bulk(AVRK_EP_IN, PID_IN, buf, size);
+}
+
+/* the single block protocol: upload, encrypt, download */
+static void avrk_encrypt_block_slot(int slot, const uint8_t *in, uint8_t *out)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        g_assert(avrk_control(VENDOR_OUT, REQ_UPLOAD_A + i,
+                              in[4 * i] | (in[4 * i + 1] << 8),
+                              in[4 * i + 2] | (in[4 * i + 3] << 8),
+                              0, NULL));
+    }
+    g_assert(avrk_control(VENDOR_OUT, REQ_START_ENCRYPT, 0, slot, 0, NULL));
+    g_assert(avrk_control(VENDOR_IN, REQ_DOWNLOAD_A, 0, 0, 8, out));
+    g_assert(avrk_control(VENDOR_IN, REQ_DOWNLOAD_A + 1, 0, 0, 8, out + 8));
+}
+
+static void avrk_encrypt_block(const uint8_t *in, uint8_t *out)
+{
+    avrk_encrypt_block_slot(0, in, out);
+}
+
+/* start QEMU with @host and the stick, passing it further @opts */
+static void avrk_test_start_opts(const AvrkHost *host, const char *opts)
+{
+    QGuestAllocator *alloc;
+    char *cmdline;
+
+    cmdline = g_strdup_printf("%s -device usb-avrk%s,filename=%s,"
+                              "persist=volatile%s", host->args, host->bus,
+                              t.state_path, opts);
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    t.host = host;
+    t.pcibus = qpci_init_pc();
+    t.dev = qpci_device_find(t.pcibus, host->devfn);
+    g_assert(t.dev != NULL);
+    t.base = qpci_iomap(t.dev, host->bar);
+    qpci_device_enable(t.dev);
+
+    alloc = pc_alloc_init();
+    t.frame_list = guest_alloc(alloc, 4096);
+    t.qh = guest_alloc(alloc, 4096);
+    t.tds = guest_alloc(alloc, 4096);
+    t.data = guest_alloc(alloc, DATA_SIZE);
+    t.ctrl = guest_alloc(alloc, 4096);
+    memset(t.toggle, 0, sizeof(t.toggle));
+
+    host->start();
+
+    /* SET_CONFIGURATION 1, the device stays at address 0 */
+    g_assert(avrk_control(0x00, 0x09, 1, 0, 0, NULL));
+}
+
+static void avrk_test_start(const AvrkHost *host)
+{
+    avrk_test_start_opts(host, "");
+}
+
+static void avrk_test_stop(void)
+{
+    qpci_iounmap(t.dev, t.base);
+    g_free(t.dev);
+    qtest_quit(global_qtest);
+}
+
+static void test_status(gconstpointer data)
+{
+    const AvrkHost *host = data;
+    uint8_t status[2], desc[32];
+
+    avrk_test_start(host);
+
+    /* the descriptors have to match the speed of the port */
+    g_assert(avrk_control(0x80, 0x06, 0x0100, 0, 18, desc));
+    g_assert_cmpint(desc[2] | desc[3] << 8, ==, host->bcd_usb);
+    g_assert_cmpint(desc[7], ==, host->ctrl_maxp);
+    g_assert(avrk_control(0x80, 0x06, 0x0200, 0, 32, desc));
+    g_assert_cmpint(desc[22] | desc[23] << 8, ==, host->bulk_maxp);
+
+    g_assert(avrk_control(VENDOR_IN, REQ_STATUS, 0, 0, 2, status));
+    /* a stick without a state file comes up freshly flashed */
+    g_assert_cmpint(status[1], ==, 1);
+    avrk_test_stop();
+}
+
+static void test_control_ecb(gconstpointer data)
+{
+    uint8_t key[16], out[16];
+    int i;
+
+    avrk_test_start(data);
+    g_assert(avrk_control(VENDOR_OUT, REQ_CHANGE_KEY, 0, 0, 16,
+                          (uint8_t *)nist_key));
+    g_assert(avrk_control(VENDOR_IN, REQ_CHANGE_KEY, 0, 0, 16, key));
+    g_assert(memcmp(key, nist_key, 16) == 0);
+
+    for (i = 0; i < 4; i++) {
+        avrk_encrypt_block(nist_plain + 16 * i, out);
+        g_assert(memcmp(out, nist_ecb + 16 * i, 16) == 0);
+    }
+    avrk_test_stop();
+}
+
+static void test_keyslots(gconstpointer data)
+{
+    uint8_t keys[32], out[16];
+
+    avrk_test_start(data);
+
+    /* load slots 2 and 3 in one transfer, slot 0 keeps the stored key */
+    memset(keys, 0, sizeof(keys));
+    memcpy(keys + 16, nist_key, 16);
+    g_assert(avrk_control(VENDOR_OUT, REQ_CHANGE_KEY, 0, 2, 32, keys));
+    g_assert(avrk_control(VENDOR_IN, REQ_CHANGE_KEY, 0, 0, 16, out));
+    g_assert(memcmp(out, "OperatingSystems", 16) == 0);
+    g_assert(avrk_control(VENDOR_IN, REQ_CHANGE_KEY, 0, 2, 32, keys));
+    g_assert(memcmp(keys + 16, nist_key, 16) == 0);
+
+    avrk_encrypt_block_slot(3, nist_plain, out);
+    g_assert(memcmp(out, nist_ecb, 16) == 0);
+    avrk_encrypt_block_slot(0, nist_plain, out);
+    g_assert(memcmp(out, nist_ecb, 16) != 0);
+
+    /* the stream picks its slot when it is reset */
+    g_assert(avrk_control(VENDOR_OUT, REQ_STREAM_RESET, 0, 3, 0, NULL));
+    avrk_bulk_out((uint8_t *)nist_plain, 32);
+    avrk_bulk_in(keys, 32);
+    g_assert(memcmp(keys, nist_ecb, 32) == 0);
+
+    g_assert(!avrk_control(VENDOR_OUT, REQ_START_ENCRYPT, 0, AVRK_KEYSLOTS,
+                           0, NULL));
+    g_assert(!avrk_control(VENDOR_OUT, REQ_CHANGE_KEY, 0, AVRK_KEYSLOTS - 1,
+                           32, keys));
+    avrk_test_stop();
+}
+
+static void test_stream_ecb(gconstpointer data)
+{
+    uint8_t buf[64];
+
+    avrk_test_start(data);
+    g_assert(avrk_control(VENDOR_OUT, REQ_CHANGE_KEY, 0, 0, 16,
+                          (uint8_t *)nist_key));
+
+    /* a partial block is carried over until the rest arrives */
+    memcpy(buf, nist_plain, 64);
+    avrk_bulk_out(buf, 24);
+    avrk_bulk_out(buf + 24, 40);
+    avrk_bulk_in(buf, 64);
+    g_assert(memcmp(buf, nist_ecb, 64) == 0);
+    avrk_test_stop();
+}
+
+static void test_stream_cbc(gconstpointer data)
+{
+    uint8_t buf[64], iv[16];
+
+    avrk_test_start(data);
+    g_assert(avrk_control(VENDOR_OUT, REQ_CHANGE_KEY, 0, 0, 16,
+                          (uint8_t *)nist_key));
+    g_assert(avrk_control(VENDOR_OUT, REQ_SET_MODE, AVRK_MODE_CBC, 0, 0,
+                          NULL));
+    g_assert(avrk_control(VENDOR_OUT, REQ_SET_IV, 0, 0, 16,
+                          (uint8_t *)nist_cbc_iv));
+
+    memcpy(buf, nist_plain, 64);
+    avrk_bulk_out(buf, 64);
+    avrk_bulk_in(buf, 64);
+    g_assert(memcmp(buf, nist_cbc, 64) == 0);
+
+    /* the IV has advanced to the last ciphertext block */
+    g_assert(avrk_control(VENDOR_IN, REQ_SET_IV, 0, 0, 16, iv));
+    g_assert(memcmp(iv, nist_cbc + 48, 16) == 0);
+
+    /* modes outside the table are refused */
+    g_assert(!avrk_control(VENDOR_OUT, REQ_SET_MODE, 0xff, 0, 0, NULL));
+    avrk_test_stop();
+}
+
+static void test_stream_flush(gconstpointer data)
+{
+    uint8_t block[16], buf[16], ref[16];
+
+    avrk_test_start(data);
+    memcpy(block, nist_plain, 16);
+    memset(block + 5, 0, 11);
+
+    /* the flushed partial block is zero-padded */
+    avrk_bulk_out(block, 5);
+    g_assert(avrk_control(VENDOR_OUT, REQ_STREAM_FLUSH, 0, 0, 0, NULL));
+    avrk_bulk_in(buf, 16);
+    avrk_encrypt_block(block, ref);
+    g_assert(memcmp(buf, ref, 16) == 0);
+    avrk_test_stop();
+}
+
+/* chaining modes to run through the offload, and their XTS data unit */
+static const struct {
+    int mode;
+    int unit;
+} offload_modes[] = {
+    { AVRK_MODE_CBC },                          /* a single job */
+    { AVRK_MODE_CBC | AVRK_MODE_DECRYPT },
+    { AVRK_MODE_CTR },
+    { AVRK_MODE_XTS, 32 },
+    { AVRK_MODE_XTS | AVRK_MODE_DECRYPT, 32 },
+};
+
+static void avrk_stream_setup(int mode, int unit, const uint8_t *iv)
+{
+    g_assert(avrk_control(VENDOR_OUT, REQ_STREAM_RESET, 0, 0, 0, NULL));
+    g_assert(avrk_control(VENDOR_OUT, REQ_SET_MODE, mode, unit, 0, NULL));
+    g_assert(avrk_control(VENDOR_OUT, REQ_SET_IV, 0, 0, 16, (uint8_t *)iv));
+}
+
+static uint8_t *offload_plain(void)
+{
+    uint8_t *plain = g_malloc(OFFLOAD_BYTES);
+    int i;
+
+    for (i = 0; i < OFFLOAD_BYTES; i += sizeof(nist_plain)) {
+        memcpy(plain + i, nist_plain, sizeof(nist_plain));
+    }
+    return plain;
+}
+
+static void test_stream_offload(gconstpointer data)
+{
+    uint8_t *plain, *ref, *buf, ref_iv[16], iv[16];
+    int i, mode, unit;
+
+    plain = offload_plain();
+    ref = g_malloc(OFFLOAD_BYTES);
+    buf = g_malloc(OFFLOAD_BYTES);
+    avrk_test_start_opts(data, OFFLOAD_OPTS);
+    g_assert(avrk_control(VENDOR_OUT, REQ_CHANGE_KEY, 0, 0, 16,
+                          (uint8_t *)nist_key));
+
+    for (i = 0; i < ARRAY_SIZE(offload_modes); i++) {
+        mode = offload_modes[i].mode;
+        unit = offload_modes[i].unit;
+
+        /* packets of bulk_maxp bytes are processed inline */
+        avrk_stream_setup(mode, unit, nist_cbc_iv);
+        avrk_bulk_out(plain, OFFLOAD_BYTES);
+        avrk_bulk_in(ref, OFFLOAD_BYTES);
+        g_assert(avrk_control(VENDOR_IN, REQ_SET_IV, 0, 0, 16, ref_iv));
+
+        /*
+         * The first packet is split into slices.  The short one leaves a
+         * partial block, which the last packet completes before handing
+         * over the rest.
+         */
+        avrk_stream_setup(mode, unit, nist_cbc_iv);
+        avrk_bulk_packets(AVRK_EP_OUT, PID_OUT, plain, OFFLOAD_PACKET,
+                          OFFLOAD_PACKET);
+        avrk_bulk_out(plain + OFFLOAD_PACKET, 8);
+        avrk_bulk_packets(AVRK_EP_OUT, PID_OUT, plain + OFFLOAD_PACKET + 8,
+                          OFFLOAD_PACKET - 8, OFFLOAD_PACKET);
+        avrk_bulk_in(buf, OFFLOAD_BYTES);
+        g_assert(avrk_control(VENDOR_IN, REQ_SET_IV, 0, 0, 16, iv));
+
+        g_assert(memcmp(buf, ref, OFFLOAD_BYTES) == 0);
+        g_assert(memcmp(iv, ref_iv, 16) == 0);
+    }
+    avrk_test_stop();
+    g_free(plain);
+    g_free(ref);
+    g_free(buf);
+}
+
+/*
+ * Queue a control request that touches the stream in the same frame as an
+ * offloaded OUT packet.  The OUT queue head comes first in the schedule, so
+ * the offload is still running when the request arrives, and it stalls.
+ */
+static void test_stream_offload_busy(gconstpointer data)
+{
+    static const uint8_t setup[8] = {
+        VENDOR_IN, REQ_SET_IV, 0, 0, 0, 0, 16, 0,
+    };
+    uint8_t *plain, *buf, iv[16];
+
+    plain = offload_plain();
+    buf = g_malloc(OFFLOAD_PACKET);
+    avrk_test_start_opts(data, OFFLOAD_OPTS);
+    g_assert(avrk_control(VENDOR_OUT, REQ_CHANGE_KEY, 0, 0, 16,
+                          (uint8_t *)nist_key));
+    avrk_stream_setup(AVRK_MODE_CBC, 0, nist_cbc_iv);
+
+    memwrite(t.data, plain, OFFLOAD_PACKET);
+    memwrite(t.ctrl, setup, sizeof(setup));
+    ehci_write_td(0, PID_OUT, AVRK_EP_OUT, t.toggle[AVRK_EP_OUT], t.data,
+                  OFFLOAD_PACKET);
+    ehci_write_td(1, PID_SETUP, 0, 0, t.ctrl, 8);
+    ehci_write_td(2, PID_IN, 0, 1, t.ctrl + 8, 16);
+    ehci_write_td(3, PID_OUT, 0, 1, 0, 0);
+    ehci_queue(AVRK_EP_OUT, 0, 1);
+    ehci_queue(0, 1, 3);
+    g_assert(!ehci_wait(0, 1, 3));
+    g_assert(ehci_wait(AVRK_EP_OUT, 0, 1));
+
+    /* once the packet is done, the IV is its last ciphertext block */
+    avrk_bulk_in(buf, OFFLOAD_PACKET);
+    g_assert(memcmp(buf, nist_cbc, sizeof(nist_cbc)) == 0);
+    g_assert(avrk_control(VENDOR_IN, REQ_SET_IV, 0, 0, 16, iv));
+    g_assert(memcmp(iv, buf + OFFLOAD_PACKET - 16, 16) == 0);
+
+    avrk_test_stop();
+    g_free(plain);
+    g_free(buf);
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, size_t bytes, int64_t ns,
+                   uint64_t cycles)
+{
+    g_test_message("%s: %zu bytes in %" PRId64 " ms, %.1f KiB/s",
+                   what, bytes, ns / 1000000, bytes * 1e9 / 1024 / ns);
+    if (cycles) {
+        g_test_message("%s: %.0f cycles/byte", what, (double)cycles / bytes);
+    }
+}
+
+static void bench_control(gconstpointer data)
+{
+    int64_t *lat, start, t0;
+    uint64_t cycles;
+    uint8_t block[16];
+    int i, j, n = 0;
+
+    lat = g_new(int64_t, BENCH_BLOCKS * 7);
+    avrk_test_start(data);
+    memset(block, 0, sizeof(block));
+
+    start = get_ns();
+    cycles = get_cycles();
+    for (i = 0; i < BENCH_BLOCKS; i++) {
+        for (j = 0; j < 4; j++) {
+            t0 = get_ns();
+            avrk_control(VENDOR_OUT, REQ_UPLOAD_A + j, i, j, 0, NULL);
+            lat[n++] = get_ns() - t0;
+        }
+        t0 = get_ns();
+        avrk_control(VENDOR_OUT, REQ_START_ENCRYPT, 0, 0, 0, NULL);
+        lat[n++] = get_ns() - t0;
+        for (j = 0; j < 2; j++) {
+            t0 = get_ns();
+            avrk_control(VENDOR_IN, REQ_DOWNLOAD_A + j, 0, 0, 8, block);
+            lat[n++] = get_ns() - t0;
+        }
+    }
+    cycles = get_cycles() - cycles;
+    start = get_ns() - start;
+
+    qsort(lat, n, sizeof(*lat), cmp_int64);
+    g_test_message("control: %.0f blocks/s", BENCH_BLOCKS * 1e9 / start);
+    g_test_message("control: transfer latency p50 %" PRId64 " us, "
+                   "p90 %" PRId64 " us, p99 %" PRId64 " us",
+                   lat[n / 2] / 1000, lat[n * 9 / 10] / 1000,
+                   lat[n * 99 / 100] / 1000);
+    report("control", BENCH_BLOCKS * 16, start, cycles);
+
+    avrk_test_stop();
+    g_free(lat);
+}
+
+static void bench_stream(gconstpointer data)
+{
+    uint8_t *buf = g_malloc0(BENCH_STREAM_BYTES);
+    uint64_t cycles;
+    int64_t start;
+
+    avrk_test_start(data);
+    start = get_ns();
+    cycles = get_cycles();
+    avrk_bulk_out(buf, BENCH_STREAM_BYTES);
+    avrk_bulk_in(buf, BENCH_STREAM_BYTES);
+    cycles = get_cycles() - cycles;
+    report("stream", BENCH_STREAM_BYTES, get_ns() - start, cycles);
+    avrk_test_stop();
+    g_free(buf);
+}
+
+static const AvrkHost hosts[] = {
+    {
+        .name       = "uhci",
+        .args       = "-usb",
+        .bus        = "",
+        .devfn      = QPCI_DEVFN(UHCI_PCI_DEV, UHCI_PCI_FUNC),
+        .bar        = 4,
+        .ctrl_maxp  = 8,
+        .bulk_maxp  = 64,
+        .bcd_usb    = 0x0110,
+        .start      = uhci_start,
+        .write_td   = uhci_write_td,
+        .run        = uhci_run,
+    }, {
+        .name       = "ehci",
+        .args       = "-device usb-ehci,id=ehci,addr=4",
+        .bus        = ",bus=ehci.0",
+        .devfn      = QPCI_DEVFN(EHCI_PCI_DEV, 0),
+        .bar        = 0,
+        .ctrl_maxp  = 64,
+        .bulk_maxp  = 512,
+        .bcd_usb    = 0x0200,
+        .start      = ehci_start,
+        .write_td   = ehci_write_td,
+        .run        = ehci_run,
+    },
+};
+
+static const struct {
+    const char *name;
+    void (*fn)(gconstpointer data);
+    bool perf;
+    const char *host;       /* only run with this controller */
+} tests[] = {
+    { "status",                 test_status },
+    { "control/ecb",            test_control_ecb },
+    { "keyslots",               test_keyslots },
+    { "stream/ecb",             test_stream_ecb },
+    { "stream/cbc",             test_stream_cbc },
+    { "stream/flush",           test_stream_flush },
+    /* UHCI packets are never large enough to be offloaded */
+    { "stream/offload",         test_stream_offload,        false, "ehci" },
+    { "stream/offload-busy",    test_stream_offload_busy,   false, "ehci" },
+    { "bench/control",          bench_control,              true },
+    { "bench/stream",           bench_stream,               true },
+};
+
+int main(int argc, char **argv)
+{
+    const char *arch = qtest_get_arch();
+    char *path;
+    int fd, ret, i, j;
+
+    if (strcmp(arch, "i386") && strcmp(arch, "x86_64")) {
+        g_test_message("Skipping test for non-x86\n");
+        return 0;
+    }
+
+    /* an empty state file makes the stick start out freshly flashed */
+    t.state_path = g_strdup("/tmp/qtest-avrk.XXXXXX");
+    fd = mkstemp(t.state_path);
+    g_assert(fd >= 0);
+    close(fd);
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(hosts); i++) {
+        for (j = 0; j < ARRAY_SIZE(tests); j++) {
+            if (tests[j].perf && !g_test_perf()) {
+                continue;
+            }
+            if (tests[j].host && strcmp(tests[j].host, hosts[i].name)) {
+                continue;
+            }
+            path = g_strdup_printf("avrk/%s/%s", hosts[i].name,
+                                   tests[j].name);
+            qtest_add_data_func(path, &hosts[i], tests[j].fn);
+            g_free(path);
+        }
+    }
+
+    ret = g_test_run();
+
+    unlink(t.state_path);
+    g_free(t.state_path);
+    return ret;
+}
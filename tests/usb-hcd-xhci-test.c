@@ -0,0 +1,316 @@
+/*
+ * QTest testcase for the xHCI endpoint doorbells
+ *
+ * This code is licensed under the LGPL.
+ *
+ * With ioeventfd=on an endpoint doorbell only signals a notifier, and the
+ * endpoint is kicked later from the main loop.  Commands must not overtake
+ * such a kick.  The test rings the doorbell of endpoint 0 and then stops
+ * the endpoint.  The transfer the guest queued before has to complete,
+ * the endpoint has to stay stopped, and Set TR Dequeue Pointer has to
+ * succeed on it.
+ *
+ * Without KVM ioeventfds the doorbell write sets the notifier itself, so
+ * the deferred path runs under qtest as well.  qtest usually lets the main
+ * loop run the kick before the next command arrives, so this checks the
+ * sequence more than it reproduces the race.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+#include "qemu-common.h"
+
+#define XHCI_PCI_DEV    5
+
+/* capability registers */
+enum {
+    XHCI_CAPLENGTH  = 0x00,
+    XHCI_DBOFF      = 0x14,
+    XHCI_RTSOFF     = 0x18,
+};
+
+/* operational registers, at CAPLENGTH */
+enum {
+    XHCI_USBCMD     = 0x00,
+    XHCI_USBSTS     = 0x04,
+    XHCI_CRCR_LO    = 0x18,
+    XHCI_CRCR_HI    = 0x1c,
+    XHCI_DCBAAP_LO  = 0x30,
+    XHCI_DCBAAP_HI  = 0x34,
+    XHCI_CONFIG     = 0x38,
+};
+
+/* interrupter 0, at RTSOFF */
+enum {
+    XHCI_ERSTSZ     = 0x28,
+    XHCI_ERSTBA_LO  = 0x30,
+    XHCI_ERSTBA_HI  = 0x34,
+    XHCI_ERDP_LO    = 0x38,
+    XHCI_ERDP_HI    = 0x3c,
+};
+
+#define USBCMD_RS           (1 << 0)
+#define USBSTS_HCH          (1 << 0)
+
+#define TRB_SIZE            16
+#define TRB_C               (1 << 0)
+#define TRB_TYPE_SHIFT      10
+#define TRB_TR_IOC          (1 << 5)
+#define TRB_TR_IDT          (1 << 6)
+#define TRB_TR_DIR          (1 << 16)
+#define TRB_TR_TRT_IN       (3 << 16)
+#define TRB_CR_EPID_SHIFT   16
+#define TRB_CR_SLOTID_SHIFT 24
+#define TRB_EV_CC_SHIFT     24
+
+enum {
+    TR_SETUP                = 2,
+    TR_DATA                 = 3,
+    TR_STATUS               = 4,
+    CR_ENABLE_SLOT          = 9,
+    CR_ADDRESS_DEVICE       = 11,
+    CR_STOP_ENDPOINT        = 15,
+    CR_SET_TR_DEQUEUE       = 16,
+    ER_TRANSFER             = 32,
+    ER_COMMAND_COMPLETE     = 33,
+};
+
+#define CC_SUCCESS          1
+
+/* 32 byte contexts: input control, slot, endpoint 0 */
+#define CTX_SIZE            32
+#define EP_TYPE_CONTROL     (4 << 3)
+#define EP_CERR_3           (3 << 1)
+#define EP_STATE_MASK       7
+#define EP_STATE_RUNNING    1
+#define EP_STATE_STOPPED    3
+
+#define EP0_EPID            1
+#define EP0_MAXP            8
+
+#define RING_TRBS           64
+#define MAX_STEPS           1000
+#define STEP_NS             1000000
+
+typedef struct {
+    QPCIBus *pcibus;
+    QPCIDevice *dev;
+    void *base;
+    void *op;
+    void *rt;
+    void *db;
+    uint64_t dcbaa;
+    uint64_t erst;
+    uint64_t event_ring;
+    uint64_t cmd_ring;
+    uint64_t ep0_ring;
+    uint64_t ictx;
+    uint64_t octx;
+    uint64_t data;
+    int event_idx;
+    int cmd_idx;
+    int ep0_idx;
+} XHCITest;
+
+static XHCITest t;
+
+static void write_trb(uint64_t trb, uint64_t parameter, uint32_t status,
+                      uint32_t control)
+{
+    writel(trb, parameter);
+    writel(trb + 4, parameter >> 32);
+    writel(trb + 8, status);
+    writel(trb + 12, control | TRB_C);
+}
+
+/* wait for the next event of @type, skipping others; returns its status */
+static uint32_t xhci_wait_event(int type, uint32_t *control)
+{
+    uint64_t trb;
+    uint32_t ctl;
+    int i;
+
+    for (i = 0; i < MAX_STEPS; i++) {
+        trb = t.event_ring + TRB_SIZE * t.event_idx;
+        ctl = readl(trb + 12);
+        if (!(ctl & TRB_C)) {
+            clock_step(STEP_NS);
+            continue;
+        }
+        g_assert_cmpint(t.event_idx + 1, <, RING_TRBS);
+        t.event_idx++;
+        qpci_io_writel(t.dev, t.rt + XHCI_ERDP_LO,
+                       t.event_ring + TRB_SIZE * t.event_idx);
+        qpci_io_writel(t.dev, t.rt + XHCI_ERDP_HI, 0);
+        if (((ctl >> TRB_TYPE_SHIFT) & 0x3f) != type) {
+            continue;
+        }
+        if (control) {
+            *control = ctl;
+        }
+        return readl(trb + 8);
+    }
+    g_assert_not_reached();
+}
+
+/* run a command, returns its completion code */
+static int xhci_command(uint64_t parameter, uint32_t control,
+                        uint32_t *event_control)
+{
+    uint32_t status;
+
+    g_assert_cmpint(t.cmd_idx + 1, <, RING_TRBS);
+    write_trb(t.cmd_ring + TRB_SIZE * t.cmd_idx++, parameter, 0, control);
+    qpci_io_writel(t.dev, t.db, 0);
+    status = xhci_wait_event(ER_COMMAND_COMPLETE, event_control);
+    return status >> TRB_EV_CC_SHIFT;
+}
+
+static void ep0_trb(uint64_t parameter, uint32_t status, uint32_t control)
+{
+    g_assert_cmpint(t.ep0_idx + 1, <, RING_TRBS);
+    write_trb(t.ep0_ring + TRB_SIZE * t.ep0_idx++, parameter, status,
+              control);
+}
+
+static int ep0_state(void)
+{
+    return readl(t.octx + CTX_SIZE) & EP_STATE_MASK;
+}
+
+static int xhci_test_start(void)
+{
+    QGuestAllocator *alloc;
+    uint32_t control;
+    int slotid;
+
+    qtest_start("-device nec-usb-xhci,id=xhci,addr=5,ioeventfd=on,"
+                "msi=off,msix=off -device usb-tablet,bus=xhci.0");
+
+    t.pcibus = qpci_init_pc();
+    t.dev = qpci_device_find(t.pcibus, QPCI_DEVFN(XHCI_PCI_DEV, 0));
+    g_assert(t.dev != NULL);
+    t.base = qpci_iomap(t.dev, 0);
+    qpci_device_enable(t.dev);
+
+    t.op = t.base + qpci_io_readb(t.dev, t.base + XHCI_CAPLENGTH);
+    t.rt = t.base + qpci_io_readl(t.dev, t.base + XHCI_RTSOFF);
+    t.db = t.base + qpci_io_readl(t.dev, t.base + XHCI_DBOFF);
+
+    alloc = pc_alloc_init();
+    t.dcbaa = guest_alloc(alloc, 4096);
+    t.erst = guest_alloc(alloc, 4096);
+    t.event_ring = guest_alloc(alloc, 4096);
+    t.cmd_ring = guest_alloc(alloc, 4096);
+    t.ep0_ring = guest_alloc(alloc, 4096);
+    t.ictx = guest_alloc(alloc, 4096);
+    t.octx = guest_alloc(alloc, 4096);
+    t.data = guest_alloc(alloc, 4096);
+    t.event_idx = t.cmd_idx = t.ep0_idx = 0;
+
+    /* one event ring segment */
+    writel(t.erst, t.event_ring);
+    writel(t.erst + 4, 0);
+    writel(t.erst + 8, RING_TRBS);
+    qpci_io_writel(t.dev, t.rt + XHCI_ERSTSZ, 1);
+    qpci_io_writel(t.dev, t.rt + XHCI_ERDP_LO, t.event_ring);
+    qpci_io_writel(t.dev, t.rt + XHCI_ERDP_HI, 0);
+    qpci_io_writel(t.dev, t.rt + XHCI_ERSTBA_LO, t.erst);
+    qpci_io_writel(t.dev, t.rt + XHCI_ERSTBA_HI, 0);
+
+    qpci_io_writel(t.dev, t.op + XHCI_DCBAAP_LO, t.dcbaa);
+    qpci_io_writel(t.dev, t.op + XHCI_DCBAAP_HI, 0);
+    qpci_io_writel(t.dev, t.op + XHCI_CRCR_LO, t.cmd_ring | 1);
+    qpci_io_writel(t.dev, t.op + XHCI_CRCR_HI, 0);
+    qpci_io_writel(t.dev, t.op + XHCI_CONFIG, 1);
+    qpci_io_writel(t.dev, t.op + XHCI_USBCMD, USBCMD_RS);
+    g_assert(!(qpci_io_readl(t.dev, t.op + XHCI_USBSTS) & USBSTS_HCH));
+
+    g_assert_cmpint(xhci_command(0, CR_ENABLE_SLOT << TRB_TYPE_SHIFT,
+                                 &control), ==, CC_SUCCESS);
+    slotid = control >> TRB_CR_SLOTID_SHIFT;
+    writel(t.dcbaa + 8 * slotid, t.octx);
+    writel(t.dcbaa + 8 * slotid + 4, 0);
+
+    /* add the slot and endpoint 0, the tablet is on root port 1 */
+    writel(t.ictx + 4, 0x3);
+    writel(t.ictx + CTX_SIZE, 1 << 27);
+    writel(t.ictx + CTX_SIZE + 4, 1 << 16);
+    writel(t.ictx + 2 * CTX_SIZE + 4, (EP0_MAXP << 16) | EP_TYPE_CONTROL |
+                                      EP_CERR_3);
+    writel(t.ictx + 2 * CTX_SIZE + 8, t.ep0_ring | 1);
+    writel(t.ictx + 2 * CTX_SIZE + 12, 0);
+    writel(t.ictx + 2 * CTX_SIZE + 16, 8);
+    g_assert_cmpint(xhci_command(t.ictx,
+                                 (CR_ADDRESS_DEVICE << TRB_TYPE_SHIFT) |
+                                 (slotid << TRB_CR_SLOTID_SHIFT), NULL),
+                    ==, CC_SUCCESS);
+    g_assert_cmpint(ep0_state(), ==, EP_STATE_RUNNING);
+    return slotid;
+}
+
+static void xhci_test_stop(void)
+{
+    qpci_iounmap(t.dev, t.base);
+    g_free(t.dev);
+    qtest_quit(global_qtest);
+}
+
+static void test_doorbell_stop_ep(void)
+{
+    uint32_t ep = (EP0_EPID << TRB_CR_EPID_SHIFT);
+    uint8_t desc[18];
+    uint32_t status;
+    int slotid;
+
+    slotid = xhci_test_start();
+    ep |= slotid << TRB_CR_SLOTID_SHIFT;
+
+    /* GET_DESCRIPTOR(device), then ring the doorbell and stop at once */
+    ep0_trb(0x0012000001000680ULL, 8, (TR_SETUP << TRB_TYPE_SHIFT) |
+            TRB_TR_IDT | TRB_TR_TRT_IN);
+    ep0_trb(t.data, sizeof(desc), (TR_DATA << TRB_TYPE_SHIFT) | TRB_TR_DIR);
+    ep0_trb(0, 0, (TR_STATUS << TRB_TYPE_SHIFT) | TRB_TR_IOC);
+    qpci_io_writel(t.dev, t.db + 4 * slotid, EP0_EPID);
+    g_assert_cmpint(xhci_command(0, (CR_STOP_ENDPOINT << TRB_TYPE_SHIFT) |
+                                 ep, NULL), ==, CC_SUCCESS);
+
+    /* the transfer was rung before the stop, so it has run */
+    status = xhci_wait_event(ER_TRANSFER, NULL);
+    g_assert_cmpint(status >> TRB_EV_CC_SHIFT, ==, CC_SUCCESS);
+    memread(t.data, desc, sizeof(desc));
+    g_assert_cmpint(desc[0], ==, sizeof(desc));
+    g_assert_cmpint(desc[1], ==, 1);
+
+    /* and no late kick sets the endpoint running again */
+    clock_step(STEP_NS);
+    g_assert_cmpint(ep0_state(), ==, EP_STATE_STOPPED);
+    g_assert_cmpint(xhci_command((t.ep0_ring + TRB_SIZE * t.ep0_idx) | 1,
+                                 (CR_SET_TR_DEQUEUE << TRB_TYPE_SHIFT) | ep,
+                                 NULL), ==, CC_SUCCESS);
+    g_assert_cmpint(ep0_state(), ==, EP_STATE_STOPPED);
+
+    xhci_test_stop();
+}
+
+int main(int argc, char **argv)
+{
+    const char *arch = qtest_get_arch();
+
+    if (strcmp(arch, "i386") && strcmp(arch, "x86_64")) {
+        g_test_message("Skipping test for non-x86\n");
+        return 0;
+    }
+
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/xhci/doorbell/stop-ep", test_doorbell_stop_ep);
+    return g_test_run();
+}